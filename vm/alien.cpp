@@ -165,7 +165,77 @@ void factor_vm::primitive_dlclose()
 {
 	dll *d = untag_check<dll>(ctx->pop());
 	if(d->handle != NULL)
+	{
+		dlsyms.flush(d->handle);
 		ffi_dlclose(d);
+	}
+}
+
+void *dlsym_cache::lookup(void *handle, const symbol_char *name)
+{
+	std::map<void *, std::map<std::string, void *> >::const_iterator library
+		= symbols.find(handle);
+	if(library != symbols.end())
+	{
+		std::map<std::string, void *>::const_iterator sym = library->second.find(name);
+		if(sym != library->second.end())
+		{
+			hits++;
+			return sym->second;
+		}
+	}
+
+	misses++;
+	return NULL;
+}
+
+void dlsym_cache::insert(void *handle, const symbol_char *name, void *sym)
+{
+	symbols[handle][name] = sym;
+}
+
+/* Symbols looked up in the global namespace may have come from the library
+being closed, so they are dropped too */
+void dlsym_cache::flush(void *handle)
+{
+	symbols.erase(handle);
+	symbols.erase(NULL);
+	flushes++;
+}
+
+dlsym_cache_statistics dlsym_cache::statistics()
+{
+	dlsym_cache_statistics stats;
+	stats.hits = hits;
+	stats.misses = misses;
+	stats.flushes = flushes;
+	stats.entries = 0;
+
+	std::map<void *, std::map<std::string, void *> >::const_iterator iter;
+	for(iter = symbols.begin(); iter != symbols.end(); iter++)
+		stats.entries += iter->second.size();
+
+	return stats;
+}
+
+/* Look up a symbol referenced by compiled code, going through dlsyms */
+void *factor_vm::cached_dlsym_raw(dll *d, symbol_char *name)
+{
+	void *handle = (d ? d->handle : NULL);
+	void *sym = dlsyms.lookup(handle,name);
+	if(!sym)
+	{
+		sym = ffi_dlsym_raw(d,name);
+		if(sym)
+			dlsyms.insert(handle,name,sym);
+	}
+	return sym;
+}
+
+void factor_vm::primitive_dlsym_cache_stats()
+{
+	dlsym_cache_statistics stats = dlsyms.statistics();
+	ctx->push(tag<byte_array>(byte_array_from_value(&stats)));
 }
 
 void factor_vm::primitive_dll_validp()
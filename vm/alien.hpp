@@ -1,4 +1,31 @@
 namespace factor
 {
 
+/* See basis/vm/vm.factor */
+struct dlsym_cache_statistics {
+	cell hits;
+	cell misses;
+	cell flushes;
+	cell entries;
+};
+
+/* Symbols which compiled code links against. Without it, every code block
+initialization goes to the dynamic linker for each RT_DLSYM relocation, and
+most code blocks link against the same few symbols. Keyed by library handle,
+so that closing a library drops its symbols before the handle can be reused.
+Failed lookups are not cached, since the symbol might become visible later. */
+struct dlsym_cache {
+	std::map<void *, std::map<std::string, void *> > symbols;
+	cell hits;
+	cell misses;
+	cell flushes;
+
+	dlsym_cache() : hits(0), misses(0), flushes(0) {}
+
+	void *lookup(void *handle, const symbol_char *name);
+	void insert(void *handle, const symbol_char *name, void *sym);
+	void flush(void *handle);
+	dlsym_cache_statistics statistics();
+};
+
 }
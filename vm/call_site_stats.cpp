@@ -0,0 +1,282 @@
+#include "master.hpp"
+
+namespace factor
+{
+
+call_site_class *call_site::class_entry(cell klass)
+{
+	std::vector<call_site_class>::iterator iter;
+	for(iter = classes.begin(); iter != classes.end(); iter++)
+	{
+		if(iter->klass == klass)
+			return &*iter;
+	}
+
+	classes.push_back(call_site_class(klass));
+	return &classes.back();
+}
+
+bool call_site::megamorphic_p()
+{
+	return !transitions.empty() && transitions.back() == call_site_megamorphic;
+}
+
+call_site *call_site_stats::find_site(cell return_address)
+{
+	std::map<cell,cell>::const_iterator iter = site_indices.find(return_address);
+	if(iter == site_indices.end())
+		return NULL;
+	else
+		return &sites[iter->second];
+}
+
+call_site *call_site_stats::site(cell return_address, cell generic_word, bool tail_call_p)
+{
+	call_site *existing = find_site(return_address);
+	if(existing && existing->generic_word == generic_word)
+		return existing;
+
+	/* A different generic word at the same address means the old
+	site's code block was freed and the space reused before the next GC
+	noticed */
+	if(existing)
+		existing->valid = false;
+
+	site_indices[return_address] = sites.size();
+	sites.push_back(call_site(return_address,generic_word,tail_call_p));
+	return &sites.back();
+}
+
+void call_site_stats::clear()
+{
+	sites.clear();
+	site_indices.clear();
+}
+
+/* Only called when nothing is iterating over the sites, since a GC may
+invalidate sites at any allocation */
+void call_site_stats::purge()
+{
+	std::vector<call_site> live;
+	std::vector<call_site>::const_iterator iter;
+	for(iter = sites.begin(); iter != sites.end(); iter++)
+	{
+		if(iter->valid)
+			live.push_back(*iter);
+	}
+
+	sites.swap(live);
+	rebuild_index();
+}
+
+void call_site_stats::update_for_sweep(mark_bits<code_block> *state)
+{
+	std::vector<call_site>::iterator iter;
+	for(iter = sites.begin(); iter != sites.end(); iter++)
+	{
+		code_block *block = (code_block *)(iter->return_address & ~(data_alignment - 1));
+		if(iter->valid && !state->marked_p(block))
+			iter->valid = false;
+	}
+	rebuild_index();
+}
+
+void call_site_stats::update_for_compaction(mark_bits<code_block> *state)
+{
+	std::vector<call_site>::iterator iter;
+	for(iter = sites.begin(); iter != sites.end(); iter++)
+	{
+		code_block *block = (code_block *)(iter->return_address & ~(data_alignment - 1));
+
+		/* Offset of return address within 16-byte allocation line */
+		cell offset = iter->return_address - (cell)block;
+
+		if(iter->valid && state->marked_p(block))
+			iter->return_address = (cell)state->forward_block(block) + offset;
+		else
+			iter->valid = false;
+	}
+	rebuild_index();
+}
+
+void call_site_stats::rebuild_index()
+{
+	site_indices.clear();
+	for(cell i = 0; i < sites.size(); i++)
+	{
+		if(sites[i].valid)
+			site_indices[sites[i].return_address] = i;
+	}
+}
+
+/* Called on an inline cache miss, before the cache entries are updated.
+Credits each class with the hits the old stub counted for it. */
+void factor_vm::record_inline_cache_miss(cell return_address, cell generic_word,
+	bool tail_call_p, cell cache_entries_, cell klass)
+{
+	call_site *site = site_stats->site(return_address,generic_word,tail_call_p);
+	array *cache_entries = untag<array>(cache_entries_);
+
+	for(cell i = 0; i < array_capacity(cache_entries); i += pic_entry_size)
+	{
+		call_site_class *entry = site->class_entry(array_nth(cache_entries,i));
+		fixnum hits = untag_fixnum(array_nth(cache_entries,i + 2));
+		if(hits > entry->baseline)
+			entry->hits += hits - entry->baseline;
+	}
+
+	site->class_entry(klass)->misses++;
+}
+
+/* Called once the miss has been handled; new_cache_entries is the new
+stub's entries, or f if the site went megamorphic. */
+void factor_vm::record_inline_cache_update(cell return_address, cell new_cache_entries_)
+{
+	call_site *site = site_stats->find_site(return_address);
+	if(!site)
+		return;
+
+	if(!to_boolean(new_cache_entries_))
+	{
+		site->transitions.push_back(call_site_megamorphic);
+		return;
+	}
+
+	array *new_cache_entries = untag<array>(new_cache_entries_);
+	cell capacity = array_capacity(new_cache_entries);
+	site->transitions.push_back(capacity / pic_entry_size);
+
+	for(cell i = 0; i < capacity; i += pic_entry_size)
+	{
+		call_site_class *entry = site->class_entry(array_nth(new_cache_entries,i));
+		entry->baseline = untag_fixnum(array_nth(new_cache_entries,i + 2));
+	}
+}
+
+/* The megamorphic cache lookup code is in the generic word itself, so its
+misses are attributed by walking the call stack: the frame calling the
+generic word's code block is suspended at the call site. Megamorphic tail
+calls leave no such frame and are not attributed. */
+struct megamorphic_call_site_finder {
+	call_site_stats *stats;
+	cell generic_word;
+	cell frames;
+	call_site *site;
+
+	explicit megamorphic_call_site_finder(call_site_stats *stats_) :
+		stats(stats_), generic_word(false_object), frames(0), site(NULL) {}
+
+	void operator()(void *frame_top, cell frame_size, code_block *owner, void *addr)
+	{
+		if(site || frames++ > 3)
+			return;
+
+		call_site *candidate = stats->find_site((cell)addr);
+		if(candidate
+			&& candidate->megamorphic_p()
+			&& candidate->generic_word == generic_word)
+			site = candidate;
+		else
+			generic_word = owner->owner;
+	}
+};
+
+void factor_vm::record_megamorphic_cache_miss(cell klass)
+{
+	megamorphic_call_site_finder finder(site_stats);
+	iterate_callstack(ctx,finder);
+
+	if(finder.site)
+	{
+		finder.site->megamorphic_misses++;
+		finder.site->class_entry(klass)->misses++;
+	}
+}
+
+void factor_vm::primitive_set_call_site_dispatch_stats()
+{
+	bool enable = to_boolean(ctx->pop());
+
+	if(site_stats)
+	{
+		delete site_stats;
+		site_stats = NULL;
+	}
+
+	/* Send every call site back through the inline cache miss handler,
+	so that its whole history is recorded */
+	if(enable)
+	{
+		site_stats = new call_site_stats();
+		update_code_heap_words(true);
+	}
+}
+
+/* Pushes an array with an entry for each call site:
+{ owner offset generic tail? transitions classes megamorphic-misses }
+where transitions is an array of inline cache sizes, with f for the
+megamorphic transition, and classes is an array of { class hits misses }
+triples. Classes are fixnum type tags or tuple layouts.
+Allocates memory */
+void factor_vm::primitive_call_site_dispatch_stats()
+{
+	growable_array result(this);
+
+	if(site_stats)
+	{
+		site_stats->purge();
+
+		/* Allocation may GC, which forwards and invalidates sites but
+		never removes them, so indices stay good; sites must be
+		re-read after every allocation */
+		std::vector<call_site> &sites = site_stats->sites;
+		for(cell i = 0; i < sites.size(); i++)
+		{
+			growable_array transitions(this);
+			for(cell j = 0; j < sites[i].transitions.size(); j++)
+			{
+				fixnum transition = sites[i].transitions[j];
+				transitions.add(transition == call_site_megamorphic
+					? false_object
+					: tag_fixnum(transition));
+			}
+			transitions.trim();
+
+			growable_array classes(this);
+			for(cell j = 0; j < sites[i].classes.size(); j++)
+			{
+				data_root<array> triple(allot_array(3,false_object),this);
+				cell hits = from_unsigned_cell(sites[i].classes[j].hits);
+				set_array_nth(triple.untagged(),1,hits);
+				cell misses = from_unsigned_cell(sites[i].classes[j].misses);
+				set_array_nth(triple.untagged(),2,misses);
+				set_array_nth(triple.untagged(),0,sites[i].classes[j].klass);
+				classes.add(triple.value());
+			}
+			classes.trim();
+
+			data_root<array> entry(allot_array(7,false_object),this);
+			cell megamorphic_misses = from_unsigned_cell(sites[i].megamorphic_misses);
+			set_array_nth(entry.untagged(),6,megamorphic_misses);
+			set_array_nth(entry.untagged(),2,sites[i].generic_word);
+			set_array_nth(entry.untagged(),3,tag_boolean(sites[i].tail_call_p));
+			set_array_nth(entry.untagged(),4,transitions.elements.value());
+			set_array_nth(entry.untagged(),5,classes.elements.value());
+
+			/* A site may have been freed by a GC above */
+			if(sites[i].valid)
+			{
+				code_block *compiled = code->code_block_for_address(sites[i].return_address);
+				set_array_nth(entry.untagged(),0,compiled->owner);
+				set_array_nth(entry.untagged(),1,
+					tag_fixnum(sites[i].return_address - (cell)compiled->entry_point()));
+				result.add(entry.value());
+			}
+		}
+	}
+
+	result.trim();
+	ctx->push(result.elements.value());
+}
+
+}
@@ -0,0 +1,78 @@
+namespace factor
+{
+
+/* Per call site dispatch telemetry, switched on and off by the
+set-call-site-dispatch-stats primitive. Unlike dispatch_statistics, which
+only has process-wide counters, this records the inline cache transitions,
+the classes seen and the megamorphic cache misses of every generic word call
+site that misses at least once.
+
+Sites are keyed by the return address of the call. Compaction forwards
+the return addresses, and sites whose code block is freed are dropped. The
+generic words and classes are GC roots. */
+
+/* Transition into megamorphic dispatch; otherwise a transition is recorded
+as the size of the new inline cache */
+static const fixnum call_site_megamorphic = -1;
+
+struct call_site_class {
+	cell klass;
+	/* Dispatches handled by the inline cache stub, as counted by
+	PIC_COUNT_HIT */
+	cell hits;
+	/* Inline cache and megamorphic cache misses */
+	cell misses;
+	/* The hit count the current stub's entry for this class started at */
+	fixnum baseline;
+
+	explicit call_site_class(cell klass_) :
+		klass(klass_), hits(0), misses(0), baseline(0) {}
+};
+
+struct call_site {
+	cell return_address;
+	cell generic_word;
+	bool tail_call_p;
+	bool valid;
+	std::vector<fixnum> transitions;
+	std::vector<call_site_class> classes;
+	cell megamorphic_misses;
+
+	explicit call_site(cell return_address_, cell generic_word_, bool tail_call_p_) :
+		return_address(return_address_),
+		generic_word(generic_word_),
+		tail_call_p(tail_call_p_),
+		valid(true),
+		megamorphic_misses(0) {}
+
+	call_site_class *class_entry(cell klass);
+	bool megamorphic_p();
+};
+
+struct call_site_stats {
+	std::vector<call_site> sites;
+	/* Return address -> index into sites */
+	std::map<cell,cell> site_indices;
+
+	call_site *find_site(cell return_address);
+	call_site *site(cell return_address, cell generic_word, bool tail_call_p);
+	void clear();
+	void purge();
+	void update_for_sweep(mark_bits<code_block> *state);
+	void update_for_compaction(mark_bits<code_block> *state);
+	template<typename Fixup> void forward(Fixup &fixup);
+	void rebuild_index();
+};
+
+template<typename Fixup> void call_site_stats::forward(Fixup &fixup)
+{
+	std::vector<call_site>::iterator iter;
+	for(iter = sites.begin(); iter != sites.end(); iter++)
+	{
+		if(iter->valid)
+			iter->return_address = (cell)fixup.fixup_code((code_block *)iter->return_address);
+	}
+	rebuild_index();
+}
+
+}
@@ -4,14 +4,23 @@ namespace factor
 {
 
 callback_heap::callback_heap(cell size, factor_vm *parent_) :
-	seg(new segment(size,true)),
-	here(seg->start),
-	parent(parent_) {}
+	segment_size(size),
+	counts_left(0),
+	parent(parent_)
+{
+	segments.push_back(new segment(size,true));
+	here = segments.back()->start;
+}
 
 callback_heap::~callback_heap()
 {
-	delete seg;
-	seg = NULL;
+	for(cell i = 0; i < segments.size(); i++)
+		delete segments[i];
+	segments.clear();
+
+	for(cell i = 0; i < count_chunks.size(); i++)
+		delete[] count_chunks[i];
+	count_chunks.clear();
 }
 
 void factor_vm::init_callbacks(cell size)
@@ -58,24 +67,59 @@ void callback_heap::store_callback_operand(code_block *stub, cell index, cell va
 
 void callback_heap::update(code_block *stub)
 {
-	store_callback_operand(stub,setup_seh_p() ? 2 : 1,(cell)callback_entry_point(stub));
+	store_callback_operand(stub,setup_seh_p() ? 3 : 2,(cell)callback_entry_point(stub));
 	stub->flush_icache();
 }
 
-code_block *callback_heap::add(cell owner, cell return_rewind)
+static const cell invocation_count_chunk_size = 256;
+
+cell *callback_heap::allot_invocation_count()
 {
-	tagged<array> code_template(parent->special_objects[CALLBACK_STUB]);
-	tagged<byte_array> insns(array_nth(code_template.untagged(),1));
-	cell size = array_capacity(insns.untagged());
+	if(counts_left == 0)
+	{
+		count_chunks.push_back(new cell[invocation_count_chunk_size]);
+		counts_left = invocation_count_chunk_size;
+	}
+
+	return &count_chunks.back()[invocation_count_chunk_size - counts_left--];
+}
 
+/* Stubs are all the same size, so any freed stub can be reused */
+code_block *callback_heap::allot(cell size)
+{
 	cell bump = align(size + sizeof(code_block),data_alignment);
-	if(here + bump > seg->end) fatal_error("Out of callback space",0);
+
+	if(!free_stubs.empty() && free_stubs.back()->size() == bump)
+	{
+		code_block *stub = free_stubs.back();
+		free_stubs.pop_back();
+		return stub;
+	}
+
+	if(here + bump > segments.back()->end)
+	{
+		segments.push_back(new segment(std::max(segment_size,bump),true));
+		here = segments.back()->start;
+	}
 
 	free_heap_block *free_block = (free_heap_block *)here;
 	free_block->make_free(bump);
 	here += bump;
 
-	code_block *stub = (code_block *)free_block;
+	return (code_block *)free_block;
+}
+
+code_block *callback_heap::add(cell owner, cell return_rewind)
+{
+	tagged<array> code_template(parent->special_objects[CALLBACK_STUB]);
+	tagged<byte_array> insns(array_nth(code_template.untagged(),1));
+	cell size = array_capacity(insns.untagged());
+
+	code_block *stub = allot(size);
+	bool reused_p = (invocation_counts.count(stub) != 0);
+	if(!reused_p)
+		invocation_counts[stub] = allot_invocation_count();
+
 	stub->owner = owner;
 	stub->parameters = false_object;
 	stub->relocation = false_object;
@@ -95,19 +139,42 @@ code_block *callback_heap::add(cell owner, cell return_rewind)
 	else
 		index = 0;
 
+	/* Store invocation count address */
+	*invocation_count(stub) = 0;
+	store_callback_operand(stub,index + 1,(cell)invocation_count(stub));
+
 	/* Store VM pointer */
-	store_callback_operand(stub,index + 2,(cell)parent);
+	store_callback_operand(stub,index + 3,(cell)parent);
 
 	/* On x86, the RET instruction takes an argument which depends on
 	the callback's calling convention */
 	if(return_takes_param_p())
-		store_callback_operand(stub,index + 3,return_rewind);
+		store_callback_operand(stub,index + 4,return_rewind);
 
 	update(stub);
 
+	/* Perf map entries cannot be retracted, so a reused stub keeps the name
+	it was first recorded with until the map is next rewritten. Its gdb
+	entry was removed when it was freed */
+	if(parent->perf && !reused_p)
+		parent->perf->record_code_block(stub,"callback ");
+	if(parent->gdb)
+		parent->gdb->add_code_block(stub);
+
 	return stub;
 }
 
+/* C code must not call the stub again; it will be reused by the next
+callback */
+void callback_heap::free(code_block *stub)
+{
+	if(parent->gdb)
+		parent->gdb->remove_code_block(stub);
+
+	stub->owner = false_object;
+	free_stubs.push_back(stub);
+}
+
 struct callback_updater {
 	callback_heap *callbacks;
 
@@ -137,4 +204,58 @@ void factor_vm::primitive_callback()
 	ctx->push(allot_alien(func));
 }
 
+struct callback_finder {
+	cell owner;
+	code_block *stub;
+
+	explicit callback_finder(cell owner_) : owner(owner_), stub(NULL) {}
+
+	void operator()(code_block *stub_)
+	{
+		if(stub_->owner == owner)
+			stub = stub_;
+	}
+};
+
+/* Frees the stub of a callback bottom word, once C code no longer holds on
+to its function pointer */
+void factor_vm::primitive_free_callback()
+{
+	tagged<word> w(ctx->pop());
+	w.untag_check(this);
+
+	callback_finder finder(w.value());
+	callbacks->each_callback(finder);
+	if(finder.stub)
+		callbacks->free(finder.stub);
+}
+
+struct callback_collector {
+	std::vector<code_block *> stubs;
+
+	void operator()(code_block *stub)
+	{
+		stubs.push_back(stub);
+	}
+};
+
+/* Outputs an array of pairs, each holding a callback bottom word and the
+number of times C code has called its stub */
+void factor_vm::primitive_callback_counts()
+{
+	callback_collector collector;
+	callbacks->each_callback(collector);
+
+	growable_array counts(this);
+	std::vector<code_block *>::const_iterator iter;
+	for(iter = collector.stubs.begin(); iter != collector.stubs.end(); iter++)
+	{
+		cell count = from_unsigned_cell(*callbacks->invocation_count(*iter));
+		counts.add(allot_array_2((*iter)->owner,count));
+	}
+
+	counts.trim();
+	ctx->push(counts.elements.value());
+}
+
 }
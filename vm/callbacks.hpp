@@ -5,28 +5,42 @@ namespace factor
 actually jump to when C code invokes them.
 
 The callback heap has entries that look like code_blocks from the code heap, but
-callback heap entries are allocated contiguously, never deallocated, and all
-fields but the owner are set to false_object. The owner points to the callback
-bottom word, whose entry point is the callback body itself, generated by the
-optimizing compiler. The machine code that follows a callback stub consists of a
-single CALLBACK_STUB machine code template, which performs a jump to a "far"
-address (on PowerPC and x86-64, its loaded into a register first).
+callback heap entries are allocated contiguously, never moved, and all fields but
+the owner are set to false_object. The owner points to the callback bottom word,
+whose entry point is the callback body itself, generated by the optimizing
+compiler. The machine code that follows a callback stub consists of a single
+CALLBACK_STUB machine code template, which counts the invocation, then performs
+a jump to a "far" address (on PowerPC and x86-64, its loaded into a register
+first). Invocation counts are kept in a separate table of plain memory, so
+that stubs never write to executable memory; a stub's count stays at the
+same address for as long as the stub exists.
 
 GC updates the CALLBACK_STUB code if the code block of the callback bottom word
-is ever moved. The callback stub itself won't move, though, and is never
-deallocated. This means that the callback stub itself is a stable function
-pointer that C code can hold on to until the associated Factor VM exits.
+is ever moved. The callback stub itself won't move, though. This means that the
+callback stub itself is a stable function pointer that C code can hold on to
+until the callback is freed or the associated Factor VM exits.
 
-Since callback stubs are GC roots, and are never deallocated, the associated
-callback code in the code heap is also never deallocated.
+Callback stubs are GC roots, so the associated callback code in the code heap
+is kept alive until the stub is freed with the free-callback primitive. Freed
+stubs have an owner of false_object, and are reused by later callbacks. When
+there are no freed stubs and the current segment is full, another segment of
+the same size is added; existing stubs stay where they are.
 
 The callback heap is not saved in the image. Running GC in a new session after
 saving the image will deallocate any code heap entries that were only reachable
 from the callback heap in the previous session when the image was saved. */
 
 struct callback_heap {
-	segment *seg;
+	/* All segments but the last are full */
+	std::vector<segment *> segments;
+	cell segment_size;
 	cell here;
+	std::vector<code_block *> free_stubs;
+	/* Every stub ever allocated, with the address of its invocation count.
+	Counts are allocated in chunks which are never freed or moved */
+	std::map<code_block *, cell *> invocation_counts;
+	std::vector<cell *> count_chunks;
+	cell counts_left;
 	factor_vm *parent;
 
 	explicit callback_heap(cell size, factor_vm *parent);
@@ -38,6 +52,11 @@ struct callback_heap {
 		return w->entry_point;
 	}
 
+	cell *invocation_count(code_block *stub)
+	{
+		return invocation_counts[stub];
+	}
+
 	bool setup_seh_p();
 	bool return_takes_param_p();
 	instruction_operand callback_operand(code_block *stub, cell index);
@@ -46,7 +65,10 @@ struct callback_heap {
 
 	void update(code_block *stub);
 
+	cell *allot_invocation_count();
+	code_block *allot(cell size);
 	code_block *add(cell owner, cell return_rewind);
+	void free(code_block *stub);
 
 	void update();
 
@@ -55,14 +77,21 @@ struct callback_heap {
 		return (code_block *)((cell)stub + stub->size());
 	}
 
+	/* Visits live stubs only. The unused space at the end of a full segment
+	reads as a zero header, since segments are fresh anonymous mappings */
 	template<typename Iterator> void each_callback(Iterator &iter)
 	{
-		code_block *scan = (code_block *)seg->start;
-		code_block *end = (code_block *)here;
-		while(scan < end)
+		for(cell i = 0; i < segments.size(); i++)
 		{
-			iter(scan);
-			scan = next(scan);
+			code_block *scan = (code_block *)segments[i]->start;
+			code_block *end = (code_block *)(i == segments.size() - 1
+				? here : segments[i]->end);
+			while(scan < end && scan->header != 0)
+			{
+				if(to_boolean(scan->owner))
+					iter(scan);
+				scan = next(scan);
+			}
 		}
 	}
 };
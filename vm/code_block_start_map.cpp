@@ -0,0 +1,79 @@
+#include "master.hpp"
+
+namespace factor
+{
+
+code_block_start_map::code_block_start_map(cell size_, cell start_) :
+	size(size_),
+	start(start_),
+	bits_size((size_ / data_alignment + mark_bits_granularity - 1) / mark_bits_granularity),
+	bits(new cell[bits_size])
+{
+	clear_block_starts();
+}
+
+code_block_start_map::~code_block_start_map()
+{
+	delete[] bits;
+	bits = NULL;
+}
+
+void code_block_start_map::clear_block_starts()
+{
+	memset(bits,0,bits_size * sizeof(cell));
+}
+
+void code_block_start_map::record_block_start(code_block *compiled)
+{
+	cell line = ((cell)compiled - start) / data_alignment;
+	bits[line / mark_bits_granularity] |= (cell)1 << (line & mark_bits_mask);
+}
+
+/* Forget all block starts in [address,address+size) */
+void code_block_start_map::clear_block_starts(cell address, cell size)
+{
+	cell first = (address - start) / data_alignment;
+	cell last = (address + size - start) / data_alignment;
+
+	while(first < last)
+	{
+		cell index = first / mark_bits_granularity;
+		cell shift = first & mark_bits_mask;
+		cell count = std::min(last - first,(cell)mark_bits_granularity - shift);
+		cell mask = (count == (cell)mark_bits_granularity
+			? (cell)-1
+			: (((cell)1 << count) - 1) << shift);
+		bits[index] &= ~mask;
+		first += count;
+	}
+}
+
+bool code_block_start_map::block_start_p(code_block *compiled)
+{
+	cell line = ((cell)compiled - start) / data_alignment;
+	return (bits[line / mark_bits_granularity] & ((cell)1 << (line & mark_bits_mask))) != 0;
+}
+
+/* The block containing an address is the one with the closest start at or
+below it. Code blocks are small, so this rarely looks further back than
+the word holding the address's own bit. */
+code_block *code_block_start_map::find_block_containing(cell address)
+{
+	cell line = (address - start) / data_alignment;
+	cell index = line / mark_bits_granularity;
+	cell shift = line & mark_bits_mask;
+
+	/* Mask off starts above the address. (1 << (shift + 1)) would be an
+	out of range shift for the last line in a word; (2 << shift) wraps to 0. */
+	cell word = bits[index] & (((cell)2 << shift) - 1);
+
+	while(word == 0)
+	{
+		FACTOR_ASSERT(index > 0);
+		word = bits[--index];
+	}
+
+	return (code_block *)(start + (index * mark_bits_granularity + log2(word)) * data_alignment);
+}
+
+}
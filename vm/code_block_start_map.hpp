@@ -0,0 +1,22 @@
+namespace factor
+{
+
+/* One bit for every data_alignment bytes of the code heap, set where a live
+code block starts. Only block addresses are stored, so lookups remain valid
+while compaction is moving the blocks themselves around. */
+struct code_block_start_map {
+	cell size, start;
+	cell bits_size;
+	cell *bits;
+
+	explicit code_block_start_map(cell size_, cell start_);
+	~code_block_start_map();
+
+	void clear_block_starts();
+	void record_block_start(code_block *compiled);
+	void clear_block_starts(cell address, cell size);
+	bool block_start_p(code_block *compiled);
+	code_block *find_block_containing(cell address);
+};
+
+}
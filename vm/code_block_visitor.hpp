@@ -117,19 +117,19 @@ void code_block_visitor<Fixup>::visit_context_code_blocks()
 template<typename Fixup>
 void code_block_visitor<Fixup>::visit_uninitialized_code_blocks()
 {
-	std::map<code_block *, cell> *uninitialized_blocks = &parent->code->uninitialized_blocks;
-	std::map<code_block *, cell>::const_iterator iter = uninitialized_blocks->begin();
-	std::map<code_block *, cell>::const_iterator end = uninitialized_blocks->end();
+	std::vector<uninitialized_block> &blocks = parent->code->uninitialized_blocks;
 
-	std::map<code_block *, cell> new_uninitialized_blocks;
-	for(; iter != end; iter++)
-	{
-		new_uninitialized_blocks.insert(std::make_pair(
-			fixup.fixup_code(iter->first),
-			iter->second));
-	}
+	/* Initialized blocks may since have been freed, so drop their entries
+	before forwarding the rest */
+	parent->code->erase_initialized();
+
+	for(cell i = 0; i < blocks.size(); i++)
+		blocks[i].compiled = fixup.fixup_code(blocks[i].compiled);
 
-	parent->code->uninitialized_blocks = new_uninitialized_blocks;
+	/* Compaction slides blocks down in order, but optimize-code-layout
+	permutes them, so the table has to be sorted again */
+	if(blocks.size() > 1)
+		parent->code->uninitialized_sorted_p = false;
 }
 
 template<typename Fixup>
@@ -22,7 +22,7 @@ cell code_block::scan(factor_vm *vm, void *addr) const
 				obj = obj.as<word>()->def;
 
 			if(obj.type_p(QUOTATION_TYPE))
-				return tag_fixnum(vm->quot_code_offset_to_scan(obj.value(),offset(addr)));
+				return tag_fixnum(vm->quot_code_offset_to_scan((code_block *)this,obj.value(),offset(addr)));
 			else
 				return false_object;
 		}
@@ -163,12 +163,13 @@ void factor_vm::update_word_references(code_block *compiled, bool reset_inline_c
 	   the code heap with dead PICs that will be freed on the next
 	   GC, we add them to the free list immediately. */
 	else if(reset_inline_caches && compiled->pic_p())
-		code->free(compiled);
+		free_code_block(compiled);
 	else
 	{
 		update_word_references_relocation_visitor visitor(this,reset_inline_caches);
 		compiled->each_instruction_operand(visitor);
 		compiled->flush_icache();
+		code->record_callees(compiled);
 	}
 }
 
@@ -190,7 +191,7 @@ cell factor_vm::compute_dlsym_address(array *parameters, cell index)
 	case BYTE_ARRAY_TYPE:
 		{
 			symbol_char *name = alien_offset(symbol);
-			void *sym = ffi_dlsym(d,name);
+			void *sym = FUNCTION_CODE_POINTER(cached_dlsym_raw(d,name));
 
 			if(sym)
 				return (cell)sym;
@@ -203,7 +204,7 @@ cell factor_vm::compute_dlsym_address(array *parameters, cell index)
 			for(cell i = 0; i < array_capacity(names); i++)
 			{
 				symbol_char *name = alien_offset(array_nth(names,i));
-				void *sym = ffi_dlsym(d,name);
+				void *sym = FUNCTION_CODE_POINTER(cached_dlsym_raw(d,name));
 
 				if(sym)
 					return (cell)sym;
@@ -234,7 +235,7 @@ cell factor_vm::compute_dlsym_toc_address(array *parameters, cell index)
 	case BYTE_ARRAY_TYPE:
 		{
 			symbol_char *name = alien_offset(symbol);
-			void* toc = ffi_dlsym_toc(d,name);
+			void *toc = FUNCTION_TOC_POINTER(cached_dlsym_raw(d,name));
 			if(toc)
 				return (cell)toc;
 			else
@@ -246,7 +247,7 @@ cell factor_vm::compute_dlsym_toc_address(array *parameters, cell index)
 			for(cell i = 0; i < array_capacity(names); i++)
 			{
 				symbol_char *name = alien_offset(array_nth(names,i));
-				void *toc = ffi_dlsym_toc(d,name);
+				void *toc = FUNCTION_TOC_POINTER(cached_dlsym_raw(d,name));
 
 				if(toc)
 					return (cell)toc;
@@ -370,6 +371,7 @@ void factor_vm::initialize_code_block(code_block *compiled, cell literals)
 	initial_code_block_visitor visitor(this,literals);
 	compiled->each_instruction_operand(visitor);
 	compiled->flush_icache();
+	code->record_callees(compiled);
 
 	/* next time we do a minor GC, we have to trace this code block, since
 	the newly-installed instruction operands might point to literals in
@@ -379,9 +381,8 @@ void factor_vm::initialize_code_block(code_block *compiled, cell literals)
 
 void factor_vm::initialize_code_block(code_block *compiled)
 {
-	std::map<code_block *,cell>::iterator iter = code->uninitialized_blocks.find(compiled);
-	initialize_code_block(compiled,iter->second);
-	code->uninitialized_blocks.erase(iter);
+	initialize_code_block(compiled,code->find_uninitialized(compiled)->literals);
+	code->remove_uninitialized(compiled);
 }
 
 /* Fixup labels. This is done at compile time, not image load time */
@@ -402,7 +403,45 @@ void factor_vm::fixup_labels(array *labels, code_block *compiled)
 	}
 }
 
+/* Might GC. Converts a table of fixed-width relocation entries, as built by
+the compiler and the JIT, into the compact format stored in code blocks */
+byte_array *factor_vm::compact_relocation(byte_array *relocation_)
+{
+	data_root<byte_array> relocation(relocation_,this);
+
+	cell length = array_capacity(relocation.untagged()) / sizeof(relocation_entry);
+	cell size = 0;
+	cell offset = 0;
+	for(cell i = 0; i < length; i++)
+	{
+		relocation_entry rel = relocation->data<relocation_entry>()[i];
+		size += compact_relocation_entry_size(rel,offset);
+		offset = rel.rel_offset();
+	}
+
+	byte_array *compact = allot_uninitialized_array<byte_array>(size);
+
+	u8 *out = compact->data<u8>();
+	offset = 0;
+	for(cell i = 0; i < length; i++)
+	{
+		relocation_entry rel = relocation->data<relocation_entry>()[i];
+		out = write_compact_relocation_entry(out,rel,offset);
+		offset = rel.rel_offset();
+	}
+
+	return compact;
+}
+
 /* Might GC */
+/* For blocks freed outside of GC */
+void factor_vm::free_code_block(code_block *compiled)
+{
+	if(gdb)
+		gdb->remove_code_block(compiled);
+	code->free(compiled);
+}
+
 code_block *factor_vm::allot_code_block(cell size, code_block_type type)
 {
 	code_block *block = code->allocator->allot(size + sizeof(code_block));
@@ -442,6 +481,11 @@ code_block *factor_vm::add_code_block(code_block_type type, cell code_, cell lab
 	data_root<array> parameters(parameters_,this);
 	data_root<array> literals(literals_,this);
 
+	/* Done before the block is allocated, since it might GC, and the GC would
+	free a block which is not yet in the uninitialized table */
+	if(relocation.type() == BYTE_ARRAY_TYPE && array_capacity(relocation.untagged()) != 0)
+		relocation = compact_relocation(relocation.untagged());
+
 	cell code_length = array_capacity(code.untagged());
 	code_block *compiled = allot_code_block(code_length,type);
 
@@ -471,13 +515,18 @@ code_block *factor_vm::add_code_block(code_block_type type, cell code_, cell lab
 	block's instruction operands. In most cases this is done right after this
 	method returns, except when compiling words with the non-optimizing
 	compiler at the beginning of bootstrap */
-	this->code->uninitialized_blocks.insert(std::make_pair(compiled,literals.value()));
-	this->code->all_blocks.insert((cell)compiled);
+	this->code->add_uninitialized(compiled,literals.value());
+	this->code->block_starts->record_block_start(compiled);
 
 	/* next time we do a minor GC, we have to trace this code block, since
 	the fields of the code_block struct might point into nursery or aging */
 	this->code->write_barrier(compiled);
 
+	if(perf)
+		perf->record_code_block(compiled);
+	if(gdb)
+		gdb->add_code_block(compiled);
+
 	return compiled;
 }
 
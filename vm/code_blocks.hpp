@@ -111,13 +111,16 @@ struct code_block
 			byte_array *rels = (byte_array *)UNTAG(relocation);
 
 			cell index = 0;
-			cell length = (rels->capacity >> TAG_BITS) / sizeof(relocation_entry);
+			cell offset = 0;
+			const u8 *scan = rels->data<u8>();
+			const u8 *end = scan + (rels->capacity >> TAG_BITS);
 
-			for(cell i = 0; i < length; i++)
+			while(scan < end)
 			{
-				relocation_entry rel = rels->data<relocation_entry>()[i];
+				relocation_entry rel = read_compact_relocation_entry(scan,offset);
 				iter(instruction_operand(rel,this,index));
 				index += rel.number_of_parameters();
+				offset = rel.rel_offset();
 			}
 		}
 	}
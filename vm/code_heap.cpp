@@ -12,14 +12,21 @@ code_heap::code_heap(cell size)
 	cell start = seg->start + getpagesize() + seh_area_size;
 
 	allocator = new free_list_allocator<code_block>(seg->end - start,start);
+	block_starts = new code_block_start_map(seg->end - start,start);
 
 	/* See os-windows-x86.64.cpp for seh_area usage */
 	safepoint_page = (void *)seg->start;
 	seh_area = (char *)seg->start + getpagesize();
+
+	callers_valid = false;
+	uninitialized_sorted_p = true;
+	initialized_count = 0;
 }
 
 code_heap::~code_heap()
 {
+	delete block_starts;
+	block_starts = NULL;
 	delete allocator;
 	allocator = NULL;
 	delete seg;
@@ -38,9 +45,95 @@ void code_heap::clear_remembered_set()
 	points_to_aging.clear();
 }
 
+void code_heap::add_uninitialized(code_block *compiled, cell literals)
+{
+	if(!uninitialized_blocks.empty() && uninitialized_blocks.back().compiled > compiled)
+		uninitialized_sorted_p = false;
+	uninitialized_blocks.push_back(uninitialized_block(compiled,literals));
+}
+
+uninitialized_block *code_heap::find_uninitialized(code_block *compiled)
+{
+	if(uninitialized_blocks.empty())
+		return NULL;
+
+	if(!uninitialized_sorted_p)
+	{
+		std::sort(uninitialized_blocks.begin(),uninitialized_blocks.end());
+		uninitialized_sorted_p = true;
+	}
+
+	std::vector<uninitialized_block>::iterator iter = std::lower_bound(
+		uninitialized_blocks.begin(),
+		uninitialized_blocks.end(),
+		uninitialized_block(compiled,false_object));
+
+	/* A block freed before it was initialized can leave an entry behind
+	for a later block at the same address */
+	for(; iter != uninitialized_blocks.end() && iter->compiled == compiled; iter++)
+	{
+		if(!iter->initialized_p)
+			return &*iter;
+	}
+
+	return NULL;
+}
+
+static bool initialized_block_p(const uninitialized_block &block)
+{
+	return block.initialized_p;
+}
+
+void code_heap::remove_uninitialized(code_block *compiled)
+{
+	uninitialized_block *block = find_uninitialized(compiled);
+	if(!block)
+		return;
+
+	/* Erasing from the middle of the table each time would make
+	initializing n blocks one at a time quadratic */
+	block->initialized_p = true;
+	block->literals = false_object;
+	initialized_count++;
+
+	if(initialized_count * 2 >= uninitialized_blocks.size())
+		erase_initialized();
+}
+
+/* Removing entries keeps the rest in order, so a sorted table stays sorted */
+void code_heap::erase_initialized()
+{
+	if(initialized_count == 0)
+		return;
+
+	uninitialized_blocks.erase(
+		std::remove_if(uninitialized_blocks.begin(),
+			uninitialized_blocks.end(),
+			initialized_block_p),
+		uninitialized_blocks.end());
+	initialized_count = 0;
+}
+
 bool code_heap::uninitialized_p(code_block *compiled)
 {
-	return uninitialized_blocks.count(compiled) > 0;
+	return find_uninitialized(compiled) != NULL;
+}
+
+/* A code heap with less than 1/32 of its size free has too little free space
+to be worth compacting, however scattered */
+static const cell min_fragmented_code_heap_share = 32;
+
+/* The code heap is fragmented when at least threshold percent of its free
+space lies outside its largest free block */
+bool code_heap::high_fragmentation_p(cell threshold)
+{
+	u64 free_space = allocator->free_space();
+	u64 largest_free_block = allocator->largest_free_block();
+
+	if(threshold == 0 || free_space < allocator->size / min_fragmented_code_heap_share)
+		return false;
+
+	return (free_space - largest_free_block) * 100 >= free_space * threshold;
 }
 
 bool code_heap::marked_p(code_block *compiled)
@@ -63,7 +156,9 @@ void code_heap::free(code_block *compiled)
 	FACTOR_ASSERT(!uninitialized_p(compiled));
 	points_to_nursery.erase(compiled);
 	points_to_aging.erase(compiled);
-	all_blocks.erase((cell)compiled);
+	remove_from_callers(compiled);
+	scan_positions.erase(compiled);
+	block_starts->clear_block_starts((cell)compiled,compiled->size());
 	allocator->free(compiled);
 }
 
@@ -72,82 +167,211 @@ void code_heap::flush_icache()
 	factor::flush_icache(seg->start,seg->size);
 }
 
-struct clear_free_blocks_from_all_blocks_iterator
+struct clear_free_blocks_from_block_starts_iterator
 {
 	code_heap *code;
 
-	clear_free_blocks_from_all_blocks_iterator(code_heap *code) : code(code) {}
+	clear_free_blocks_from_block_starts_iterator(code_heap *code) : code(code) {}
 
 	void operator()(code_block *free_block, cell size) {
-		std::set<cell>::iterator erase_from =
-			code->all_blocks.lower_bound((cell)free_block);
-		std::set<cell>::iterator erase_to =
-			code->all_blocks.lower_bound((cell)free_block + size);
-
-		code->all_blocks.erase(erase_from, erase_to);
+		code->block_starts->clear_block_starts((cell)free_block,size);
 	}
 };
 
 void code_heap::sweep()
 {
-	clear_free_blocks_from_all_blocks_iterator clearer(this);
+	clear_free_blocks_from_block_starts_iterator clearer(this);
 	allocator->sweep(clearer);
 #ifdef FACTOR_DEBUG
-	verify_all_blocks_set();
+	verify_block_starts();
 #endif
 }
 
-struct all_blocks_set_verifier {
-	std::set<cell> *all_blocks;
+struct block_starts_verifier {
+	code_block_start_map *block_starts;
 
-	all_blocks_set_verifier(std::set<cell> *all_blocks) : all_blocks(all_blocks) {}
+	block_starts_verifier(code_block_start_map *block_starts) : block_starts(block_starts) {}
 
 	void operator()(code_block *block, cell size)
 	{
-		FACTOR_ASSERT(all_blocks->find((cell)block) != all_blocks->end());
+		FACTOR_ASSERT(block_starts->block_start_p(block));
 	}
 };
 
-void code_heap::verify_all_blocks_set()
+void code_heap::verify_block_starts()
 {
-	all_blocks_set_verifier verifier(&all_blocks);
+	block_starts_verifier verifier(block_starts);
 	allocator->iterate(verifier);
 }
 
 code_block *code_heap::code_block_for_address(cell address)
 {
-	std::set<cell>::const_iterator blocki =
-		all_blocks.upper_bound(address);
-	FACTOR_ASSERT(blocki != all_blocks.begin());
-	--blocki;
-	code_block* found_block = (code_block*)*blocki;
+	code_block *found_block = block_starts->find_block_containing(address);
 	FACTOR_ASSERT((cell)found_block->entry_point() <= address
 		/* XXX this isn't valid during fixup. should store the size in the map
 		&& address - (cell)found_block->entry_point() < found_block->size()*/);
 	return found_block;
 }
 
-struct all_blocks_set_inserter {
-	code_heap *code;
+struct block_starts_recorder {
+	code_block_start_map *block_starts;
 
-	all_blocks_set_inserter(code_heap *code) : code(code) {}
+	block_starts_recorder(code_block_start_map *block_starts) : block_starts(block_starts) {}
 
 	void operator()(code_block *block, cell size)
 	{
-		code->all_blocks.insert((cell)block);
+		block_starts->record_block_start(block);
 	}
 };
 
-void code_heap::initialize_all_blocks_set()
+void code_heap::initialize_block_starts()
 {
-	all_blocks.clear();
-	all_blocks_set_inserter inserter(this);
-	allocator->iterate(inserter);
+	block_starts->clear_block_starts();
+	block_starts_recorder recorder(block_starts);
+	allocator->iterate(recorder);
 #if defined(FACTOR_DEBUG)
-	verify_all_blocks_set();
+	verify_block_starts();
 #endif
 }
 
+void code_heap::add_caller(code_block *callee, code_block *caller)
+{
+	if(callers_valid)
+		callers[callee].insert(caller);
+}
+
+template<typename Visitor> struct callee_visitor {
+	Visitor *visitor;
+
+	explicit callee_visitor(Visitor *visitor_) : visitor(visitor_) {}
+
+	void operator()(instruction_operand op)
+	{
+		switch(op.rel_type())
+		{
+		case RT_ENTRY_POINT:
+		case RT_ENTRY_POINT_PIC:
+		case RT_ENTRY_POINT_PIC_TAIL:
+			(*visitor)(op.load_code_block(),op.compiled);
+			break;
+		default:
+			break;
+		}
+	}
+};
+
+struct caller_adder {
+	code_heap *code;
+
+	explicit caller_adder(code_heap *code_) : code(code_) {}
+
+	void operator()(code_block *callee, code_block *caller)
+	{
+		code->add_caller(callee,caller);
+	}
+};
+
+struct caller_remover {
+	code_heap *code;
+
+	explicit caller_remover(code_heap *code_) : code(code_) {}
+
+	void operator()(code_block *callee, code_block *caller)
+	{
+		std::map<code_block *, std::set<code_block *> >::iterator iter
+			= code->callers.find(callee);
+		if(iter != code->callers.end())
+			iter->second.erase(caller);
+	}
+};
+
+/* Call after the block's instruction operands are stored */
+void code_heap::record_callees(code_block *caller)
+{
+	if(!callers_valid) return;
+
+	caller_adder adder(this);
+	callee_visitor<caller_adder> visitor(&adder);
+	caller->each_instruction_operand(visitor);
+}
+
+void code_heap::remove_from_callers(code_block *compiled)
+{
+	if(!callers_valid) return;
+
+	caller_remover remover(this);
+	callee_visitor<caller_remover> visitor(&remover);
+	compiled->each_instruction_operand(visitor);
+
+	callers.erase(compiled);
+}
+
+struct callers_builder {
+	code_heap *code;
+
+	explicit callers_builder(code_heap *code_) : code(code_) {}
+
+	void operator()(code_block *compiled, cell size)
+	{
+		/* Instruction operands of uninitialized blocks are not stored yet;
+		initialize_code_block() records them */
+		if(!code->uninitialized_p(compiled))
+			code->record_callees(compiled);
+	}
+};
+
+void code_heap::build_callers()
+{
+	callers.clear();
+	callers_valid = true;
+
+	callers_builder builder(this);
+	allocator->iterate(builder);
+}
+
+void code_heap::update_callers_for_sweep()
+{
+	update_callers_for_compaction(&allocator->state);
+}
+
+/* Drops the blocks which are about to be freed. The survivors are
+forwarded separately, if they move. */
+void code_heap::update_callers_for_compaction(mark_bits<code_block> *state)
+{
+	if(!callers_valid) return;
+
+	std::map<code_block *, std::set<code_block *> >::iterator iter = callers.begin();
+	while(iter != callers.end())
+	{
+		if(!state->marked_p(iter->first))
+			callers.erase(iter++);
+		else
+		{
+			std::set<code_block *>::iterator caller = iter->second.begin();
+			while(caller != iter->second.end())
+			{
+				if(state->marked_p(*caller))
+					caller++;
+				else
+					iter->second.erase(caller++);
+			}
+			iter++;
+		}
+	}
+}
+
+void code_heap::update_scan_positions_for_sweep()
+{
+	std::map<code_block *, std::vector<scan_position> >::iterator iter = scan_positions.begin();
+	while(iter != scan_positions.end())
+	{
+		if(marked_p(iter->first))
+			iter++;
+		else
+			scan_positions.erase(iter++);
+	}
+}
+
 /* Allocate a code heap during startup */
 void factor_vm::init_code_heap(cell size)
 {
@@ -174,19 +398,48 @@ void factor_vm::update_code_heap_words(bool reset_inline_caches)
 {
 	word_updater updater(this,reset_inline_caches);
 	each_code_block(updater);
+
+	/* All PICs were freed */
+	if(reset_inline_caches) pic_stubs.clear();
+}
+
+/* Relink the code blocks which call a code block that has been replaced.
+Cheaper than update_code_heap_words(false) when few words were redefined,
+since it only visits the callers. */
+void factor_vm::update_callers(code_block *old_block)
+{
+	if(!code->callers_valid)
+		code->build_callers();
+
+	std::map<code_block *, std::set<code_block *> >::iterator iter
+		= code->callers.find(old_block);
+	if(iter == code->callers.end())
+		return;
+
+	/* Relinking adds callers to the new blocks, not to this one */
+	std::vector<code_block *> old_callers(iter->second.begin(),iter->second.end());
+	code->callers.erase(iter);
+
+	std::vector<code_block *>::const_iterator caller;
+	for(caller = old_callers.begin(); caller != old_callers.end(); caller++)
+		update_word_references(*caller,false);
 }
 
 /* Fix up new words only.
 Fast path for compilation units that only define new words. */
 void factor_vm::initialize_code_blocks()
 {
-	std::map<code_block *, cell>::const_iterator iter = code->uninitialized_blocks.begin();
-	std::map<code_block *, cell>::const_iterator end = code->uninitialized_blocks.end();
+	std::vector<uninitialized_block> &blocks = code->uninitialized_blocks;
 
-	for(; iter != end; iter++)
-		initialize_code_block(iter->first,iter->second);
+	for(cell i = 0; i < blocks.size(); i++)
+	{
+		if(!blocks[i].initialized_p)
+			initialize_code_block(blocks[i].compiled,blocks[i].literals);
+	}
 
-	code->uninitialized_blocks.clear();
+	blocks.clear();
+	code->uninitialized_sorted_p = true;
+	code->initialized_count = 0;
 }
 
 void factor_vm::primitive_modify_code_heap()
@@ -200,6 +453,11 @@ void factor_vm::primitive_modify_code_heap()
 	if(count == 0)
 		return;
 
+	/* Unless inline caches are being reset, which means visiting every
+	call site anyway, only the callers of each word's old code block are
+	relinked */
+	bool relink_callers = update_existing_words && !reset_inline_caches;
+
 	for(cell i = 0; i < count; i++)
 	{
 		data_root<array> pair(array_nth(alist.untagged(),i),this);
@@ -207,6 +465,11 @@ void factor_vm::primitive_modify_code_heap()
 		data_root<word> word(array_nth(pair.untagged(),0),this);
 		data_root<object> data(array_nth(pair.untagged(),1),this);
 
+		/* Compilation may move the old code block, or free it if nothing
+		calls it */
+		code_root old_block(word->entry_point ? (cell)word->code() : 0,this);
+		old_block.valid = relink_callers && word->entry_point;
+
 		switch(data.type())
 		{
 		case QUOTATION_TYPE:
@@ -239,12 +502,29 @@ void factor_vm::primitive_modify_code_heap()
 			critical_error("Expected a quotation or an array",data.value());
 			break;
 		}
+
+		if(old_block.valid)
+			update_callers((code_block *)old_block.value);
 	}
 
-	if(update_existing_words)
-		update_code_heap_words(reset_inline_caches);
+	if(update_existing_words && reset_inline_caches)
+		update_code_heap_words(true);
 	else
 		initialize_code_blocks();
+
+	if(perf)
+		perf->flush();
+	if(gdb)
+		gdb->flush();
+}
+
+/* Tell external tools where code blocks went after compaction */
+void factor_vm::update_code_heap_symbols()
+{
+	if(perf)
+		perf->record_all_code_blocks(code,callbacks);
+	if(gdb)
+		gdb->register_all_code_blocks(code,callbacks);
 }
 
 code_heap_room factor_vm::code_room()
@@ -266,6 +546,21 @@ void factor_vm::primitive_code_room()
 	ctx->push(tag<byte_array>(byte_array_from_value(&room)));
 }
 
+/* Pack the code blocks of the given words and quotations, typically the
+ones the sampling profiler saw running, together at the start of the code
+heap so that hot code shares cache lines and pages. */
+void factor_vm::primitive_optimize_code_layout()
+{
+	data_root<array> owners(ctx->pop(),this);
+	owners.untag_check(this);
+
+	/* Squeeze out free blocks first, so that the blocks being laid out
+	exactly fill the start of the code heap */
+	primitive_compact_gc();
+
+	collect_code_layout_impl(owners.untagged());
+}
+
 struct stack_trace_stripper {
 	explicit stack_trace_stripper() {}
 
@@ -7,6 +7,30 @@ namespace factor
 	const cell seh_area_size = 0;
 #endif
 
+/* The quotation position of the code emitted from code_offset on, in an
+unoptimized code block */
+struct scan_position {
+	u32 code_offset;
+	s32 position;
+};
+
+/* A block which needs to be initialized by initialize_code_block(), and the
+literal table it will be initialized with */
+struct uninitialized_block {
+	code_block *compiled;
+	cell literals;
+	/* Set once the block has been initialized, until the entry is erased */
+	bool initialized_p;
+
+	uninitialized_block(code_block *compiled_, cell literals_) :
+		compiled(compiled_), literals(literals_), initialized_p(false) {}
+
+	bool operator<(const uninitialized_block &other) const
+	{
+		return compiled < other.compiled;
+	}
+};
+
 struct code_heap {
 	/* The actual memory area */
 	segment *seg;
@@ -20,12 +44,20 @@ struct code_heap {
 	/* Memory allocator */
 	free_list_allocator<code_block> *allocator;
 
-	std::set<cell> all_blocks;
+	/* Where each live block starts, for mapping return addresses back to
+	their code blocks */
+	code_block_start_map *block_starts;
 
-	/* Keys are blocks which need to be initialized by initialize_code_block().
-	Values are literal tables. Literal table arrays are GC roots until the
-	time the block is initialized, after which point they are discarded. */
-	std::map<code_block *, cell> uninitialized_blocks;
+	/* Blocks which need to be initialized by initialize_code_block(), with
+	their literal tables. Literal table arrays are GC roots until the time the
+	block is initialized, after which point they are discarded. Blocks are
+	usually added and initialized in bulk, so this is a flat array which is
+	only sorted by address when a lookup needs it. Initializing one block
+	only marks its entry; marked entries are erased in one pass once they
+	make up half the table. */
+	std::vector<uninitialized_block> uninitialized_blocks;
+	bool uninitialized_sorted_p;
+	cell initialized_count;
 
 	/* Code blocks which may reference objects in the nursery */
 	std::set<code_block *> points_to_nursery;
@@ -33,11 +65,28 @@ struct code_heap {
 	/* Code blocks which may reference objects in aging space or the nursery */
 	std::set<code_block *> points_to_aging;
 
+	/* Keys are code blocks, values are the code blocks which call them.
+	Lets modify-code-heap relink only the callers of redefined words. Built
+	the first time it is needed, and may list callers which no longer call
+	the block. */
+	std::map<code_block *, std::set<code_block *> > callers;
+	bool callers_valid;
+
+	/* Keys are unoptimized code blocks, values are tables for mapping their
+	return addresses to quotation positions, sorted by code offset. Filled
+	in as frames are scanned, see quot_code_offset_to_scan() */
+	std::map<code_block *, std::vector<scan_position> > scan_positions;
+
 	explicit code_heap(cell size);
 	~code_heap();
 	void write_barrier(code_block *compiled);
 	void clear_remembered_set();
+	void add_uninitialized(code_block *compiled, cell literals);
+	uninitialized_block *find_uninitialized(code_block *compiled);
+	void remove_uninitialized(code_block *compiled);
+	void erase_initialized();
 	bool uninitialized_p(code_block *compiled);
+	bool high_fragmentation_p(cell threshold);
 	bool marked_p(code_block *compiled);
 	void set_marked_p(code_block *compiled);
 	void clear_mark_bits();
@@ -45,8 +94,16 @@ struct code_heap {
 	void flush_icache();
 	void guard_safepoint();
 	void unguard_safepoint();
-	void verify_all_blocks_set();
-	void initialize_all_blocks_set();
+	void verify_block_starts();
+	void initialize_block_starts();
+	void add_caller(code_block *callee, code_block *caller);
+	void record_callees(code_block *caller);
+	void remove_from_callers(code_block *compiled);
+	void build_callers();
+	void update_callers_for_sweep();
+	void update_callers_for_compaction(mark_bits<code_block> *state);
+	template<typename Fixup> void forward_callers(Fixup &fixup);
+	void update_scan_positions_for_sweep();
 
 	void sweep();
 
@@ -59,6 +116,23 @@ struct code_heap {
 	}
 };
 
+template<typename Fixup> void code_heap::forward_callers(Fixup &fixup)
+{
+	if(!callers_valid) return;
+
+	std::map<code_block *, std::set<code_block *> > forwarded;
+	std::map<code_block *, std::set<code_block *> >::const_iterator iter;
+	for(iter = callers.begin(); iter != callers.end(); iter++)
+	{
+		std::set<code_block *> &new_callers = forwarded[fixup.fixup_code(iter->first)];
+		std::set<code_block *>::const_iterator caller;
+		for(caller = iter->second.begin(); caller != iter->second.end(); caller++)
+			new_callers.insert(fixup.fixup_code(*caller));
+	}
+
+	callers.swap(forwarded);
+}
+
 struct code_heap_room {
 	cell size;
 	cell occupied_space;
@@ -195,7 +195,7 @@ void factor_vm::collect_compact_impl(bool trace_contexts_p)
 	gc_event *event = current_gc->event;
 
 #if defined(FACTOR_DEBUG)
-	code->verify_all_blocks_set();
+	code->verify_block_starts();
 #endif
 
 	if(event) event->started_compaction();
@@ -238,9 +238,16 @@ void factor_vm::collect_compact_impl(bool trace_contexts_p)
 	}
 
 	update_code_roots_for_compaction();
+	if(site_stats) site_stats->update_for_compaction(code_forwarding_map);
+	pic_stubs.clear();
+	code->update_callers_for_compaction(code_forwarding_map);
+	code->forward_callers(fixup);
+	code->scan_positions.clear();
 	callbacks->update();
 
-	code->initialize_all_blocks_set();
+	code->initialize_block_starts();
+
+	update_code_heap_symbols();
 
 	if(event) event->ended_compaction();
 }
@@ -293,10 +300,11 @@ struct code_compaction_fixup {
 	}
 };
 
+template<typename Fixup>
 struct object_grow_heap_updater {
-	code_block_visitor<code_compaction_fixup> code_forwarder;
+	code_block_visitor<Fixup> code_forwarder;
 
-	explicit object_grow_heap_updater(code_block_visitor<code_compaction_fixup> code_forwarder_) :
+	explicit object_grow_heap_updater(code_block_visitor<Fixup> code_forwarder_) :
 		code_forwarder(code_forwarder_) {}
 
 	void operator()(object *obj)
@@ -305,7 +313,7 @@ struct object_grow_heap_updater {
 	}
 };
 
-/* Compact just the code heap, after growing the data heap */
+/* Compact just the code heap, after growing the data heap or sweeping it */
 void factor_vm::collect_compact_code_impl(bool trace_contexts_p)
 {
 	/* Figure out where blocks are going to go */
@@ -324,7 +332,7 @@ void factor_vm::collect_compact_code_impl(bool trace_contexts_p)
 		code_forwarder.visit_context_code_blocks();
 
 	/* Update code heap references in data heap */
-	object_grow_heap_updater object_updater(code_forwarder);
+	object_grow_heap_updater<code_compaction_fixup> object_updater(code_forwarder);
 	each_object(object_updater);
 
 	/* Slide everything in the code heap up, and update code heap
@@ -333,7 +341,174 @@ void factor_vm::collect_compact_code_impl(bool trace_contexts_p)
 	code->allocator->compact(code_block_updater,fixup,&code_finger);
 
 	update_code_roots_for_compaction();
+	if(site_stats) site_stats->update_for_compaction(code_forwarding_map);
+	pic_stubs.clear();
+	code->update_callers_for_compaction(code_forwarding_map);
+	code->forward_callers(fixup);
+	code->scan_positions.clear();
 	callbacks->update();
+
+	update_code_heap_symbols();
+}
+
+/* Forwarding for a code heap whose blocks are being permuted rather than
+slid up. New locations come from a table keyed by the old block; the block
+start map still describes the old layout until the very end, so addresses
+inside blocks can be forwarded too. */
+struct code_layout_fixup {
+	static const bool translated_code_block_map = false;
+
+	code_block_start_map *old_starts;
+	std::map<code_block *, code_block *> *forwarding;
+
+	explicit code_layout_fixup(code_block_start_map *old_starts_,
+		std::map<code_block *, code_block *> *forwarding_) :
+		old_starts(old_starts_),
+		forwarding(forwarding_) {}
+
+	object *fixup_data(object *obj)
+	{
+		return obj;
+	}
+
+	code_block *fixup_code(code_block *compiled)
+	{
+		code_block *old_block = old_starts->find_block_containing((cell)compiled);
+		std::map<code_block *, code_block *>::const_iterator iter = forwarding->find(old_block);
+		FACTOR_ASSERT(iter != forwarding->end());
+		return (code_block *)((cell)iter->second + ((cell)compiled - (cell)old_block));
+	}
+
+	object *translate_data(const object *obj)
+	{
+		return fixup_data((object *)obj);
+	}
+
+	/* Call stacks are visited before any block moves */
+	code_block *translate_code(const code_block *compiled)
+	{
+		return (code_block *)compiled;
+	}
+
+	cell size(object *obj)
+	{
+		return obj->size();
+	}
+
+	cell size(code_block *compiled)
+	{
+		return compiled->size();
+	}
+};
+
+struct code_layout_collector {
+	std::set<code_block *> *hot;
+	std::vector<std::pair<code_block *, cell> > *order;
+
+	explicit code_layout_collector(std::set<code_block *> *hot_,
+		std::vector<std::pair<code_block *, cell> > *order_) :
+		hot(hot_), order(order_) {}
+
+	void operator()(code_block *compiled, cell size)
+	{
+		if(hot->count(compiled) == 0)
+			order->push_back(std::make_pair(compiled,size));
+	}
+};
+
+/* Rearrange the code heap so that the code blocks of the words and
+quotations in owners come first, in the given order, followed by all other
+code blocks in their current order. The code heap must have just been
+compacted, so that the live blocks exactly fill its start. */
+void factor_vm::collect_code_layout_impl(array *owners)
+{
+	std::set<code_block *> hot;
+	std::vector<std::pair<code_block *, cell> > order;
+
+	cell length = array_capacity(owners);
+	for(cell i = 0; i < length; i++)
+	{
+		cell owner = array_nth(owners,i);
+		code_block *compiled = NULL;
+
+		switch(TAG(owner))
+		{
+		case WORD_TYPE:
+			if(untag<word>(owner)->entry_point)
+				compiled = untag<word>(owner)->code();
+			break;
+		case QUOTATION_TYPE:
+			if(untag<quotation>(owner)->entry_point)
+				compiled = untag<quotation>(owner)->code();
+			break;
+		}
+
+		if(compiled && hot.insert(compiled).second)
+			order.push_back(std::make_pair(compiled,compiled->size()));
+	}
+
+	code_layout_collector collector(&hot,&order);
+	code->allocator->iterate(collector);
+
+	cell start = (cell)code->allocator->first_block();
+	cell address = start;
+
+	std::map<code_block *, code_block *> forwarding;
+	std::vector<std::pair<code_block *, cell> >::const_iterator iter;
+	for(iter = order.begin(); iter != order.end(); iter++)
+	{
+		forwarding[iter->first] = (code_block *)address;
+		address += iter->second;
+	}
+
+	FACTOR_ASSERT(address - start == code->allocator->occupied_space());
+
+	code_layout_fixup fixup(code->block_starts,&forwarding);
+	slot_visitor<code_layout_fixup> data_forwarder(this,fixup);
+	code_block_visitor<code_layout_fixup> code_forwarder(this,fixup);
+
+	/* Update everything which points into the code heap while the old
+	blocks, whose frame sizes the call stack walkers need, are still in
+	place */
+	code_forwarder.visit_code_roots();
+	code_forwarder.visit_context_code_blocks();
+
+	object_grow_heap_updater<code_layout_fixup> object_updater(code_forwarder);
+	each_object(object_updater);
+
+	std::vector<code_root *>::const_iterator root_iter;
+	for(root_iter = code_roots.begin(); root_iter != code_roots.end(); root_iter++)
+	{
+		code_root *root = *root_iter;
+		if(root->valid)
+			root->value = (cell)fixup.fixup_code((code_block *)root->value);
+	}
+
+	if(site_stats) site_stats->forward(fixup);
+	pic_stubs.clear();
+	code->forward_callers(fixup);
+	code->scan_positions.clear();
+
+	/* Blocks move both up and down, so copy them out of the way first */
+	cell size = address - start;
+	char *scratch = new char[size];
+	memcpy(scratch,(void *)start,size);
+
+	code_block_compaction_updater<code_layout_fixup> code_block_updater(this,fixup,data_forwarder,code_forwarder);
+	for(iter = order.begin(); iter != order.end(); iter++)
+	{
+		code_block *new_address = forwarding[iter->first];
+		memcpy(new_address,scratch + ((cell)iter->first - start),iter->second);
+		code_block_updater(iter->first,new_address,iter->second);
+	}
+
+	delete[] scratch;
+
+	callbacks->update();
+	code->initialize_block_starts();
+	code->flush_icache();
+
+	update_code_heap_symbols();
 }
 
 void factor_vm::collect_compact(bool trace_contexts_p)
@@ -351,6 +526,28 @@ void factor_vm::collect_compact(bool trace_contexts_p)
 	code->flush_icache();
 }
 
+/* Full mark and sweep, then compact the code heap but not the data heap */
+void factor_vm::collect_compact_code(bool trace_contexts_p)
+{
+	collect_mark_impl(trace_contexts_p);
+	collect_sweep_impl();
+
+	if(data->low_memory_p())
+	{
+		set_current_gc_op(collect_growing_heap_op);
+		collect_growing_heap(0,trace_contexts_p);
+	}
+	else if(data->high_fragmentation_p())
+	{
+		set_current_gc_op(collect_compact_op);
+		collect_compact_impl(trace_contexts_p);
+	}
+	else
+		collect_compact_code_impl(trace_contexts_p);
+
+	code->flush_icache();
+}
+
 void factor_vm::collect_growing_heap(cell requested_size, bool trace_contexts_p)
 {
 	/* Grow the data heap and copy all live objects to the new heap. */
@@ -10,6 +10,51 @@ std::ostream &operator<<(std::ostream &out, const string *str)
 	return out;
 }
 
+/* A short name for a code block's owner, for external tools such as perf
+and gdb */
+void print_code_block_owner(std::ostream &out, cell owner)
+{
+	switch(TAG(owner))
+	{
+	case WORD_TYPE:
+		{
+			word *w = untag<word>(owner);
+			if(TAG(w->vocabulary) == STRING_TYPE)
+				out << untag<string>(w->vocabulary) << ":";
+			if(TAG(w->name) == STRING_TYPE)
+				out << untag<string>(w->name);
+			else
+				out << "#<word>";
+			break;
+		}
+	case QUOTATION_TYPE:
+		{
+			/* Quotations have no name, so show the words they start with */
+			array *elements = untag<array>(untag<quotation>(owner)->array);
+			cell length = array_capacity(elements);
+			out << "[ ";
+			for(cell i = 0; i < std::min(length,(cell)3); i++)
+			{
+				cell elt = array_nth(elements,i);
+				if(TAG(elt) == WORD_TYPE)
+				{
+					print_code_block_owner(out,elt);
+					out << " ";
+				}
+				else
+					out << "... ";
+			}
+			if(length > 3)
+				out << "... ";
+			out << "]";
+			break;
+		}
+	default:
+		out << "#<unknown>";
+		break;
+	}
+}
+
 void factor_vm::print_word(word *word, cell nesting)
 {
 	if(tagged<object>(word->vocabulary).type_p(STRING_TYPE))
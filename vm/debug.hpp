@@ -1,4 +1,7 @@
 namespace factor
 {
 
+std::ostream &operator<<(std::ostream &out, const string *str);
+void print_code_block_owner(std::ostream &out, cell owner);
+
 }
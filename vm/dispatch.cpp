@@ -40,9 +40,10 @@ cell factor_vm::nth_hashcode(tuple_layout *layout, fixnum echelon)
 	return ptr[echelon * 2 + 1];
 }
 
-cell factor_vm::lookup_tuple_method(cell obj, cell methods)
+/* Walk the echelons of a tuple layout from most to least specific */
+cell factor_vm::search_tuple_method(cell layout_, cell methods)
 {
-	tuple_layout *layout = untag<tuple_layout>(untag<tuple>(obj)->layout);
+	tuple_layout *layout = untag<tuple_layout>(layout_);
 
 	array *echelons = untag<array>(methods);
 
@@ -70,6 +71,33 @@ cell factor_vm::lookup_tuple_method(cell obj, cell methods)
 	return false_object;
 }
 
+void factor_vm::clear_tuple_dispatch_cache()
+{
+	memset(tuple_dispatch_cache,0,sizeof(tuple_dispatch_cache));
+}
+
+/* Tuple method lookups are memoized, keyed on the identity of the generic
+word's tuple method table and of the tuple's layout. Defining a method
+builds new tables, and redefining a class builds a new layout, so entries
+never go stale; but objects move, so the cache is cleared by every GC. */
+cell factor_vm::lookup_tuple_method(cell obj, cell methods)
+{
+	cell layout = untag<tuple>(obj)->layout;
+
+	cell hashcode = ((methods >> TAG_BITS) * 31 + (layout >> TAG_BITS))
+		& (tuple_dispatch_cache_size - 1);
+	tuple_dispatch_entry *entry = &tuple_dispatch_cache[hashcode];
+
+	if(entry->methods != methods || entry->layout != layout)
+	{
+		entry->methods = methods;
+		entry->layout = layout;
+		entry->method = search_tuple_method(layout,methods);
+	}
+
+	return entry->method;
+}
+
 cell factor_vm::lookup_method(cell obj, cell methods)
 {
 	cell tag = TAG(obj);
@@ -102,18 +130,41 @@ cell factor_vm::object_class(cell obj)
 		return tag_fixnum(tag);
 }
 
+/* Index of the first pair in the set a class is cached in. Tuple layouts
+are 16-byte aligned, so the low bits of their addresses are mixed with
+higher ones; fixnum tags hash to their low bits. Must be kept in sync with
+the mega-lookup templates in basis/cpu/ */
 cell factor_vm::method_cache_hashcode(cell klass, array *array)
 {
-	cell capacity = (array_capacity(array) >> 1) - 1;
-	return ((klass >> TAG_BITS) & capacity) << 1;
+	cell sets = array_capacity(array) / (2 * mega_cache_ways);
+	cell hash = (klass ^ (klass >> mega_cache_hash_shift)) >> TAG_BITS;
+	return (hash & (sets - 1)) * 2 * mega_cache_ways;
 }
 
+/* The new entry goes into the first way, which is probed first, and the
+entries ahead of the first empty way move along by one. If the set is
+full, the entry in its last way is evicted. */
 void factor_vm::update_method_cache(cell cache, cell klass, cell method)
 {
 	array *cache_elements = untag<array>(cache);
-	cell hashcode = method_cache_hashcode(klass,cache_elements);
-	set_array_nth(cache_elements,hashcode,klass);
-	set_array_nth(cache_elements,hashcode + 1,method);
+	cell set = method_cache_hashcode(klass,cache_elements);
+
+	cell way = 0;
+	while(way < mega_cache_ways - 1 && to_boolean(array_nth(cache_elements,set + way * 2)))
+		way++;
+
+	if(to_boolean(array_nth(cache_elements,set + way * 2)))
+		dispatch_stats.megamorphic_cache_conflicts++;
+
+	for(; way > 0; way--)
+	{
+		cell from = set + (way - 1) * 2;
+		set_array_nth(cache_elements,from + 2,array_nth(cache_elements,from));
+		set_array_nth(cache_elements,from + 3,array_nth(cache_elements,from + 1));
+	}
+
+	set_array_nth(cache_elements,set,klass);
+	set_array_nth(cache_elements,set + 1,method);
 }
 
 void factor_vm::primitive_mega_cache_miss()
@@ -128,6 +179,8 @@ void factor_vm::primitive_mega_cache_miss()
 	cell klass = object_class(object);
 	cell method = lookup_method(object,methods);
 
+	if(site_stats) record_megamorphic_cache_miss(klass);
+
 	update_method_cache(cache,klass,method);
 
 	ctx->push(method);
@@ -136,6 +189,7 @@ void factor_vm::primitive_mega_cache_miss()
 void factor_vm::primitive_reset_dispatch_stats()
 {
 	memset(&dispatch_stats,0,sizeof(dispatch_statistics));
+	if(site_stats) site_stats->clear();
 }
 
 void factor_vm::primitive_dispatch_stats()
@@ -1,13 +1,38 @@
 namespace factor
 {
 
+/* Inline cache entries are stored as class/method/hit count triples. The hit
+count is a fixnum incremented by the PIC_COUNT_HIT stub, if the CPU backend
+provides one; otherwise it stays zero and the cache degrades to insertion
+order with a fixed size. */
+static const cell pic_entry_size = 3;
+
+/* Megamorphic caches are arrays of class/method pairs, grouped into sets of
+mega_cache_ways pairs; a class can only be cached in the set its hash picks.
+Must be kept in sync with mega-cache-ways and mega-cache-hash-shift in
+core/layouts/layouts.factor */
+static const cell mega_cache_ways = 4;
+static const cell mega_cache_hash_shift = 7;
+
+static const cell tuple_dispatch_cache_size = 1024;
+
+struct tuple_dispatch_entry {
+	cell methods;
+	cell layout;
+	cell method;
+};
+
 struct dispatch_statistics {
 	cell megamorphic_cache_hits;
 	cell megamorphic_cache_misses;
+	cell megamorphic_cache_conflicts;
 
 	cell cold_call_to_ic_transitions;
 	cell ic_to_pic_transitions;
 	cell pic_to_mega_transitions;
+	cell pic_growths;
+	cell pic_evictions;
+	cell pic_stub_reuses;
 
 	cell pic_tag_count;
 	cell pic_tuple_count;
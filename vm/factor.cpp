@@ -28,6 +28,7 @@ void factor_vm::default_parameters(vm_parameters *p)
 	p->tenured_size = 24 * sizeof(cell);
 
 	p->max_pic_size = 3;
+	p->code_fragmentation = 50;
 
 	p->fep = false;
 	p->signals = true;
@@ -39,6 +40,12 @@ void factor_vm::default_parameters(vm_parameters *p)
 #endif
 
 	p->callback_size = 256;
+
+	p->zygote_path = NULL;
+	p->startup_stats = false;
+	p->perf_map = false;
+	p->gdb_jit = false;
+	p->deferred_jit = false;
 }
 
 bool factor_vm::factor_arg(const vm_char* str, const vm_char* arg, cell* value)
@@ -53,6 +60,35 @@ bool factor_vm::factor_arg(const vm_char* str, const vm_char* arg, cell* value)
 		return false;
 }
 
+/* Returns false if the argument is not a VM switch */
+bool factor_vm::parse_vm_parameter(vm_parameters *p, vm_char *arg)
+{
+	if(factor_arg(arg,STRING_LITERAL("-datastack=%d"),&p->datastack_size));
+	else if(factor_arg(arg,STRING_LITERAL("-retainstack=%d"),&p->retainstack_size));
+	else if(factor_arg(arg,STRING_LITERAL("-callstack=%d"),&p->callstack_size));
+	else if(factor_arg(arg,STRING_LITERAL("-young=%d"),&p->young_size));
+	else if(factor_arg(arg,STRING_LITERAL("-aging=%d"),&p->aging_size));
+	else if(factor_arg(arg,STRING_LITERAL("-tenured=%d"),&p->tenured_size));
+	else if(factor_arg(arg,STRING_LITERAL("-codeheap=%d"),&p->code_size));
+	else if(factor_arg(arg,STRING_LITERAL("-pic=%d"),&p->max_pic_size));
+	else if(factor_arg(arg,STRING_LITERAL("-code-fragmentation=%d"),&p->code_fragmentation));
+	else if(factor_arg(arg,STRING_LITERAL("-callbacks=%d"),&p->callback_size));
+	else if(STRCMP(arg,STRING_LITERAL("-fep")) == 0) p->fep = true;
+	else if(STRCMP(arg,STRING_LITERAL("-nosignals")) == 0) p->signals = false;
+	else if(STRNCMP(arg,STRING_LITERAL("-i="),3) == 0) p->image_path = arg + 3;
+	else if(STRCMP(arg,STRING_LITERAL("-console")) == 0) p->console = true;
+	else if(STRCMP(arg,STRING_LITERAL("-startup-stats")) == 0) p->startup_stats = true;
+	else if(STRCMP(arg,STRING_LITERAL("-gdb-jit")) == 0) p->gdb_jit = true;
+	else if(STRCMP(arg,STRING_LITERAL("-deferred-jit")) == 0) p->deferred_jit = true;
+#if !defined(WINDOWS)
+	else if(STRNCMP(arg,STRING_LITERAL("-zygote="),8) == 0) p->zygote_path = arg + 8;
+	else if(STRCMP(arg,STRING_LITERAL("-perf-map")) == 0) p->perf_map = true;
+#endif
+	else return false;
+
+	return true;
+}
+
 void factor_vm::init_parameters_from_args(vm_parameters *p, int argc, vm_char **argv)
 {
 	default_parameters(p);
@@ -64,19 +100,7 @@ void factor_vm::init_parameters_from_args(vm_parameters *p, int argc, vm_char **
 	{
 		vm_char *arg = argv[i];
 		if(STRCMP(arg,STRING_LITERAL("--")) == 0) break;
-		else if(factor_arg(arg,STRING_LITERAL("-datastack=%d"),&p->datastack_size));
-		else if(factor_arg(arg,STRING_LITERAL("-retainstack=%d"),&p->retainstack_size));
-		else if(factor_arg(arg,STRING_LITERAL("-callstack=%d"),&p->callstack_size));
-		else if(factor_arg(arg,STRING_LITERAL("-young=%d"),&p->young_size));
-		else if(factor_arg(arg,STRING_LITERAL("-aging=%d"),&p->aging_size));
-		else if(factor_arg(arg,STRING_LITERAL("-tenured=%d"),&p->tenured_size));
-		else if(factor_arg(arg,STRING_LITERAL("-codeheap=%d"),&p->code_size));
-		else if(factor_arg(arg,STRING_LITERAL("-pic=%d"),&p->max_pic_size));
-		else if(factor_arg(arg,STRING_LITERAL("-callbacks=%d"),&p->callback_size));
-		else if(STRCMP(arg,STRING_LITERAL("-fep")) == 0) p->fep = true;
-		else if(STRCMP(arg,STRING_LITERAL("-nosignals")) == 0) p->signals = false;
-		else if(STRNCMP(arg,STRING_LITERAL("-i="),3) == 0) p->image_path = arg + 3;
-		else if(STRCMP(arg,STRING_LITERAL("-console")) == 0) p->console = true;
+		parse_vm_parameter(p,arg);
 	}
 }
 
@@ -85,9 +109,14 @@ void factor_vm::prepare_boot_image()
 {
 	std::cout << "*** Stage 2 early init... " << std::flush;
 
+	u64 start = nano_count();
 	compile_all_words();
 	update_code_heap_words(true);
+	startup_stats.compile_all_words_time = nano_count() - start;
+
+	start = nano_count();
 	initialize_all_quotations();
+	startup_stats.initialize_all_quotations_time = nano_count() - start;
 	special_objects[OBJ_STAGE2] = true_object;
 
 	std::cout << "done" << std::endl;
@@ -95,6 +124,8 @@ void factor_vm::prepare_boot_image()
 
 void factor_vm::init_factor(vm_parameters *p)
 {
+	startup_stats.start_time = nano_count();
+
 	/* Kilobytes */
 	p->datastack_size = align_page(p->datastack_size << 10);
 	p->retainstack_size = align_page(p->retainstack_size << 10);
@@ -131,11 +162,24 @@ void factor_vm::init_factor(vm_parameters *p)
 
 	srand((unsigned int)nano_count());
 	init_ffi();
+	u64 start = nano_count();
 	init_contexts(p->datastack_size,p->retainstack_size,p->callstack_size);
+	startup_stats.init_contexts_time = nano_count() - start;
 	init_callbacks(p->callback_size);
 	load_image(p);
+#if !defined(WINDOWS)
+	if(p->perf_map)
+		init_perf_map();
+#endif
+	if(p->gdb_jit)
+	{
+		gdb = new gdb_jit();
+		gdb->register_all_code_blocks(code,callbacks);
+	}
 	init_c_io();
 	init_inline_caching((int)p->max_pic_size);
+	deferred_jit_p = p->deferred_jit;
+	code_fragmentation_threshold = p->code_fragmentation;
 	special_objects[OBJ_CPU] = allot_alien(false_object,(cell)FACTOR_CPU_STRING);
 	special_objects[OBJ_OS] = allot_alien(false_object,(cell)FACTOR_OS_STRING);
 	special_objects[OBJ_CELL_SIZE] = tag_fixnum(sizeof(cell));
@@ -150,12 +194,42 @@ void factor_vm::init_factor(vm_parameters *p)
 	if(!to_boolean(special_objects[OBJ_STAGE2]))
 		prepare_boot_image();
 
+	/* In zygote mode, signal handlers and the console thread are set up
+	by each forked worker in start_standalone_factor() */
+	if(p->zygote_path == NULL)
+		init_signals_and_console(p);
+
+	startup_stats.total_time = nano_count() - startup_stats.start_time;
+
+	if(p->startup_stats)
+		print_startup_stats();
+}
+
+void factor_vm::print_startup_stats()
+{
+	std::cout << "*** VM startup phases (microseconds):" << std::endl;
+	std::cout << "init_contexts: " << startup_stats.init_contexts_time / 1000 << std::endl;
+	std::cout << "load_data_heap: " << startup_stats.load_data_heap_time / 1000 << std::endl;
+	std::cout << "load_code_heap: " << startup_stats.load_code_heap_time / 1000 << std::endl;
+	std::cout << "fixup_data: " << startup_stats.fixup_data_time / 1000 << std::endl;
+	std::cout << "fixup_code: " << startup_stats.fixup_code_time / 1000 << std::endl;
+	std::cout << "compile_all_words: " << startup_stats.compile_all_words_time / 1000 << std::endl;
+	std::cout << "initialize_all_quotations: " << startup_stats.initialize_all_quotations_time / 1000 << std::endl;
+	std::cout << "total: " << startup_stats.total_time / 1000 << std::endl;
+}
+
+void factor_vm::primitive_startup_stats()
+{
+	ctx->push(tag<byte_array>(byte_array_from_value(&startup_stats)));
+}
+
+void factor_vm::init_signals_and_console(vm_parameters *p)
+{
 	if(p->signals)
 		init_signals();
 
 	if(p->console)
 		open_console();
-
 }
 
 /* May allocate memory */
@@ -214,6 +288,14 @@ void factor_vm::start_standalone_factor(int argc, vm_char **argv)
 	default_parameters(&p);
 	init_parameters_from_args(&p,argc,argv);
 	init_factor(&p);
+#if !defined(WINDOWS)
+	if(p.zygote_path)
+	{
+		/* Only returns in a forked worker */
+		run_zygote(&p,&argc,&argv);
+		init_signals_and_console(&p);
+	}
+#endif
 	pass_args_to_factor(argc,argv);
 	start_factor(&p);
 }
@@ -19,6 +19,7 @@ template<typename Block> struct free_list_allocator {
 	Block *allot(cell size);
 	void free(Block *block);
 	cell occupied_space();
+	cell allocated_extent();
 	cell free_space();
 	cell largest_free_block();
 	cell free_block_count();
@@ -104,6 +105,25 @@ template<typename Block> void free_list_allocator<Block>::free(Block *block)
 	free_blocks.add_to_free_list(free_block);
 }
 
+/* Offset just past the last allocated block. Equal to occupied_space() right
+after compaction, but larger if there are free blocks in between. */
+template<typename Block> cell free_list_allocator<Block>::allocated_extent()
+{
+	cell extent = 0;
+	Block *scan = first_block();
+	Block *end = last_block();
+
+	while(scan != end)
+	{
+		Block *next = (Block *)((cell)scan + scan->size());
+		if(!scan->free_p())
+			extent = (cell)next - start;
+		scan = next;
+	}
+
+	return extent;
+}
+
 template<typename Block> cell free_list_allocator<Block>::free_space()
 {
 	return free_blocks.free_space;
@@ -99,6 +99,11 @@ void factor_vm::collect_sweep_impl()
 	if(event) event->ended_data_sweep();
 
 	update_code_roots_for_sweep();
+	if(site_stats) site_stats->update_for_sweep(&code->allocator->state);
+	pic_stubs.update_for_sweep(&code->allocator->state);
+	if(gdb) gdb->update_for_sweep(&code->allocator->state);
+	code->update_callers_for_sweep();
+	code->update_scan_positions_for_sweep();
 
 	if(event) event->started_code_sweep();
 	code->sweep();
@@ -154,9 +154,18 @@ void factor_vm::gc(gc_op op, cell requested_size, bool trace_contexts_p)
 	are promoted before any unreachable tenured objects are freed. */
 	FACTOR_ASSERT(!data->high_fragmentation_p());
 
+	/* Code blocks waiting to be registered with gdb might be freed, and
+	their perf map entries would then describe the wrong code */
+	if(perf)
+		perf->flush();
+	if(gdb)
+		gdb->flush();
+
 	current_gc = new gc_state(op,this);
 	atomic::store(&current_gc_p, true);
 
+	clear_tuple_dispatch_cache();
+
 	/* Keep trying to GC higher and higher generations until we don't run
 	out of space in the target generation. */
 	for(;;)
@@ -201,6 +210,9 @@ void factor_vm::gc(gc_op op, cell requested_size, bool trace_contexts_p)
 			case collect_growing_heap_op:
 				collect_growing_heap(requested_size,trace_contexts_p);
 				break;
+			case collect_compact_code_op:
+				collect_compact_code(trace_contexts_p);
+				break;
 			default:
 				critical_error("Bad GC op",current_gc->op);
 				break;
@@ -222,6 +234,10 @@ void factor_vm::gc(gc_op op, cell requested_size, bool trace_contexts_p)
 	delete current_gc;
 	current_gc = NULL;
 
+	/* Drop the symbols of blocks freed by the sweep */
+	if(gdb)
+		gdb->flush();
+
 	/* Check the invariant again, just in case. */
 	FACTOR_ASSERT(!data->high_fragmentation_p());
 }
@@ -290,6 +306,21 @@ void factor_vm::primitive_compact_gc()
 		true /* trace contexts? */);
 }
 
+void factor_vm::primitive_compact_code_gc()
+{
+	gc(collect_compact_code_op,
+		0, /* requested size */
+		true /* trace contexts? */);
+}
+
+/* Called while no thread is runnable. Compacting the code heap now avoids
+a longer pause later, when an allocation finds no free block large enough
+and compacts the data heap along with it */
+void factor_vm::primitive_code_heap_fragmentedp()
+{
+	ctx->push(tag_boolean(code->high_fragmentation_p(code_fragmentation_threshold)));
+}
+
 /*
  * It is up to the caller to fill in the object's fields in a meaningful
  * fashion!
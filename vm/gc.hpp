@@ -7,7 +7,8 @@ enum gc_op {
 	collect_to_tenured_op,
 	collect_full_op,
 	collect_compact_op,
-	collect_growing_heap_op
+	collect_growing_heap_op,
+	collect_compact_code_op
 };
 
 struct gc_event {
@@ -3,14 +3,26 @@
 namespace factor
 {
 
+/* The compiler emits return addresses in the order their call sites appear
+in the code block, so the table is sorted and we can binary search it. */
 cell gc_info::return_address_index(cell return_address)
 {
 	u32 *return_address_array = return_addresses();
 
-	for(cell i = 0; i < return_address_count; i++)
+	cell low = 0;
+	cell high = return_address_count;
+
+	while(low < high)
 	{
-		if(return_address == return_address_array[i])
-			return i;
+		cell middle = low + (high - low) / 2;
+		cell address = return_address_array[middle];
+
+		if(address == return_address)
+			return middle;
+		else if(address < return_address)
+			low = middle + 1;
+		else
+			high = middle;
 	}
 
 	return (cell)-1;
@@ -0,0 +1,402 @@
+#include "master.hpp"
+
+extern "C" {
+
+/* Other JITs loaded into the same process define these too. They are weak,
+so that the linker picks a single copy; since the protocol is fixed by
+GDB, code blocks from every JIT then end up in the same list. */
+#if defined(__GNUC__)
+__attribute__((noinline,weak))
+#elif defined(_MSC_VER)
+__declspec(noinline)
+#endif
+void __jit_debug_register_code()
+{
+	/* GDB puts a breakpoint here; make sure the call is not optimized
+	away */
+#if defined(__GNUC__)
+	asm volatile("");
+#endif
+}
+
+#if defined(__GNUC__)
+__attribute__((weak))
+#endif
+jit_descriptor __jit_debug_descriptor = { 1, 0, NULL, NULL };
+
+}
+
+namespace factor
+{
+
+enum jit_actions {
+	JIT_NOACTION = 0,
+	JIT_REGISTER_FN,
+	JIT_UNREGISTER_FN
+};
+
+/* Several VMs in one process share the descriptor */
+static volatile cell gdb_jit_lock = 0;
+
+static void lock_gdb_jit()
+{
+	while(!atomic::cas(&gdb_jit_lock,0,1)) {}
+}
+
+static void unlock_gdb_jit()
+{
+	atomic::store(&gdb_jit_lock,(cell)0);
+}
+
+/* The ELF header and section headers have the same fields on 32 and 64 bit
+platforms, with address-sized fields being a cell wide. Symbols have their
+fields in a different order. */
+struct elf_header {
+	u8 ident[16];
+	u16 type;
+	u16 machine;
+	u32 version;
+	cell entry;
+	cell phoff;
+	cell shoff;
+	u32 flags;
+	u16 ehsize;
+	u16 phentsize;
+	u16 phnum;
+	u16 shentsize;
+	u16 shnum;
+	u16 shstrndx;
+};
+
+struct elf_section_header {
+	u32 name;
+	u32 type;
+	cell flags;
+	cell addr;
+	cell offset;
+	cell size;
+	u32 link;
+	u32 info;
+	cell addralign;
+	cell entsize;
+};
+
+#ifdef FACTOR_64
+struct elf_symbol {
+	u32 name;
+	u8 info;
+	u8 other;
+	u16 shndx;
+	cell value;
+	cell size;
+};
+#else
+struct elf_symbol {
+	u32 name;
+	cell value;
+	cell size;
+	u8 info;
+	u8 other;
+	u16 shndx;
+};
+#endif
+
+enum elf_section_index {
+	elf_null_section,
+	elf_text_section,
+	elf_shstrtab_section,
+	elf_strtab_section,
+	elf_symtab_section,
+	elf_section_count
+};
+
+static const char elf_section_names[] = "\0.text\0.shstrtab\0.strtab\0.symtab";
+
+static u16 elf_machine()
+{
+#if defined(FACTOR_AMD64)
+	return 62; /* EM_X86_64 */
+#elif defined(FACTOR_X86)
+	return 3; /* EM_386 */
+#elif defined(FACTOR_PPC64)
+	return 21; /* EM_PPC64 */
+#elif defined(FACTOR_PPC32)
+	return 20; /* EM_PPC */
+#elif defined(FACTOR_ARM)
+	return 40; /* EM_ARM */
+#else
+	return 0;
+#endif
+}
+
+static bool little_endian_p()
+{
+	u16 probe = 1;
+	return *(u8 *)&probe == 1;
+}
+
+/* Build a relocatable ELF object with an empty .text section spanning the
+given code blocks, and a function symbol for each of them */
+static std::vector<u8> make_gdb_jit_symfile(std::vector<code_block *> &blocks)
+{
+	cell text_start = (cell)-1;
+	cell text_end = 0;
+
+	std::string strtab(1,'\0');
+	std::vector<elf_symbol> symtab(1);
+	memset(&symtab[0],0,sizeof(elf_symbol));
+
+	std::vector<code_block *>::const_iterator iter;
+	for(iter = blocks.begin(); iter != blocks.end(); iter++)
+	{
+		cell start = (cell)(*iter)->entry_point();
+		cell end = (cell)*iter + (*iter)->size();
+		text_start = std::min(text_start,start);
+		text_end = std::max(text_end,end);
+	}
+
+	for(iter = blocks.begin(); iter != blocks.end(); iter++)
+	{
+		elf_symbol sym;
+		memset(&sym,0,sizeof(elf_symbol));
+		sym.name = (u32)strtab.size();
+		sym.info = 0x12; /* STB_GLOBAL, STT_FUNC */
+		sym.shndx = elf_text_section;
+		sym.value = (cell)(*iter)->entry_point() - text_start;
+		sym.size = (*iter)->size() - sizeof(code_block);
+		symtab.push_back(sym);
+
+		std::ostringstream name;
+		print_code_block_owner(name,(*iter)->owner);
+		if(!(*iter)->free_p() && (*iter)->pic_p())
+			name << " (pic)";
+		strtab += name.str();
+		strtab += '\0';
+	}
+
+	cell shstrtab_offset = sizeof(elf_header) + elf_section_count * sizeof(elf_section_header);
+	cell strtab_offset = shstrtab_offset + sizeof(elf_section_names);
+	cell symtab_offset = align(strtab_offset + strtab.size(),sizeof(cell));
+	cell symtab_size = symtab.size() * sizeof(elf_symbol);
+
+	std::vector<u8> symfile(symtab_offset + symtab_size,0);
+
+	elf_header *header = (elf_header *)&symfile[0];
+	memcpy(header->ident,"\177ELF",4);
+	header->ident[4] = sizeof(cell) == 8 ? 2 : 1; /* ELFCLASS64 or ELFCLASS32 */
+	header->ident[5] = little_endian_p() ? 1 : 2; /* ELFDATA2LSB or ELFDATA2MSB */
+	header->ident[6] = 1; /* EV_CURRENT */
+	header->type = 1; /* ET_REL */
+	header->machine = elf_machine();
+	header->version = 1;
+	header->shoff = sizeof(elf_header);
+	header->ehsize = sizeof(elf_header);
+	header->shentsize = sizeof(elf_section_header);
+	header->shnum = elf_section_count;
+	header->shstrndx = elf_shstrtab_section;
+
+	elf_section_header *sections = (elf_section_header *)&symfile[sizeof(elf_header)];
+
+	elf_section_header *text = &sections[elf_text_section];
+	text->name = 1;
+	text->type = 8; /* SHT_NOBITS */
+	text->flags = 6; /* SHF_ALLOC | SHF_EXECINSTR */
+	text->addr = text_start;
+	text->size = text_end - text_start;
+	text->addralign = data_alignment;
+
+	elf_section_header *shstrtab = &sections[elf_shstrtab_section];
+	shstrtab->name = 7;
+	shstrtab->type = 3; /* SHT_STRTAB */
+	shstrtab->offset = shstrtab_offset;
+	shstrtab->size = sizeof(elf_section_names);
+	shstrtab->addralign = 1;
+
+	elf_section_header *strtab_section = &sections[elf_strtab_section];
+	strtab_section->name = 17;
+	strtab_section->type = 3; /* SHT_STRTAB */
+	strtab_section->offset = strtab_offset;
+	strtab_section->size = strtab.size();
+	strtab_section->addralign = 1;
+
+	elf_section_header *symtab_section = &sections[elf_symtab_section];
+	symtab_section->name = 25;
+	symtab_section->type = 2; /* SHT_SYMTAB */
+	symtab_section->offset = symtab_offset;
+	symtab_section->size = symtab_size;
+	symtab_section->link = elf_strtab_section;
+	symtab_section->info = 1; /* index of the first global symbol */
+	symtab_section->addralign = sizeof(cell);
+	symtab_section->entsize = sizeof(elf_symbol);
+
+	memcpy(&symfile[shstrtab_offset],elf_section_names,sizeof(elf_section_names));
+	memcpy(&symfile[strtab_offset],strtab.data(),strtab.size());
+	memcpy(&symfile[symtab_offset],&symtab[0],symtab_size);
+
+	return symfile;
+}
+
+gdb_jit::~gdb_jit()
+{
+	unregister_all();
+}
+
+void gdb_jit::add_code_block(code_block *compiled)
+{
+	pending.push_back(compiled);
+	if(pending.size() >= gdb_jit_batch_size)
+		flush();
+}
+
+void gdb_jit::remove_code_block(code_block *compiled)
+{
+	std::vector<code_block *>::iterator pending_iter
+		= std::find(pending.begin(),pending.end(),compiled);
+	if(pending_iter != pending.end())
+		pending.erase(pending_iter);
+
+	std::map<code_block *, jit_code_entry *>::iterator iter = registered.find(compiled);
+	if(iter != registered.end())
+	{
+		stale.insert(iter->second);
+		registered.erase(iter);
+	}
+}
+
+/* Callback stubs live outside the code heap, and are not swept */
+void gdb_jit::update_for_sweep(mark_bits<code_block> *state)
+{
+	std::map<code_block *, jit_code_entry *>::iterator iter = registered.begin();
+	while(iter != registered.end())
+	{
+		cell address = (cell)iter->first;
+		if(address < state->start
+			|| address >= state->start + state->size
+			|| state->marked_p(iter->first))
+			iter++;
+		else
+		{
+			stale.insert(iter->second);
+			registered.erase(iter++);
+		}
+	}
+}
+
+/* Pending code blocks must be flushed before a GC can free them. Stale
+symbol files are replaced first, so that the blocks still alive in them
+are registered again along with the pending ones. */
+void gdb_jit::flush()
+{
+	std::set<jit_code_entry *>::const_iterator stale_iter;
+	for(stale_iter = stale.begin(); stale_iter != stale.end(); stale_iter++)
+	{
+		std::vector<code_block *> &blocks = entries[*stale_iter];
+		std::vector<code_block *>::const_iterator iter;
+		for(iter = blocks.begin(); iter != blocks.end(); iter++)
+		{
+			std::map<code_block *, jit_code_entry *>::iterator found = registered.find(*iter);
+			if(found != registered.end() && found->second == *stale_iter)
+			{
+				registered.erase(found);
+				pending.push_back(*iter);
+			}
+		}
+		unregister_entry(*stale_iter);
+	}
+	stale.clear();
+
+	if(pending.empty())
+		return;
+
+	std::vector<u8> symfile = make_gdb_jit_symfile(pending);
+
+	char *symfile_addr = new char[symfile.size()];
+	memcpy(symfile_addr,&symfile[0],symfile.size());
+
+	jit_code_entry *entry = new jit_code_entry;
+	entry->symfile_addr = symfile_addr;
+	entry->symfile_size = symfile.size();
+	entry->prev_entry = NULL;
+
+	lock_gdb_jit();
+	entry->next_entry = __jit_debug_descriptor.first_entry;
+	if(entry->next_entry)
+		entry->next_entry->prev_entry = entry;
+	__jit_debug_descriptor.first_entry = entry;
+	__jit_debug_descriptor.relevant_entry = entry;
+	__jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+	__jit_debug_register_code();
+	unlock_gdb_jit();
+
+	std::vector<code_block *>::const_iterator iter;
+	for(iter = pending.begin(); iter != pending.end(); iter++)
+		registered[*iter] = entry;
+	entries[entry].swap(pending);
+	pending.clear();
+}
+
+/* Does not touch registered, which the caller must update */
+void gdb_jit::unregister_entry(jit_code_entry *entry)
+{
+	lock_gdb_jit();
+	if(entry->prev_entry)
+		entry->prev_entry->next_entry = entry->next_entry;
+	else
+		__jit_debug_descriptor.first_entry = entry->next_entry;
+	if(entry->next_entry)
+		entry->next_entry->prev_entry = entry->prev_entry;
+	__jit_debug_descriptor.relevant_entry = entry;
+	__jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+	__jit_debug_register_code();
+	unlock_gdb_jit();
+
+	entries.erase(entry);
+
+	delete[] entry->symfile_addr;
+	delete entry;
+}
+
+void gdb_jit::unregister_all()
+{
+	pending.clear();
+
+	while(!entries.empty())
+		unregister_entry(entries.begin()->first);
+
+	registered.clear();
+	stale.clear();
+}
+
+struct gdb_jit_collector {
+	std::vector<code_block *> *blocks;
+
+	explicit gdb_jit_collector(std::vector<code_block *> *blocks_) : blocks(blocks_) {}
+
+	void operator()(code_block *compiled, cell size)
+	{
+		blocks->push_back(compiled);
+	}
+
+	void operator()(code_block *stub)
+	{
+		blocks->push_back(stub);
+	}
+};
+
+/* Replace everything registered so far with one symbol file describing the
+current code heap, after blocks have moved */
+void gdb_jit::register_all_code_blocks(code_heap *code, callback_heap *callbacks)
+{
+	unregister_all();
+
+	gdb_jit_collector collector(&pending);
+	code->allocator->iterate(collector);
+	flush();
+
+	/* The callback heap is a separate segment, so give it its own file
+	rather than one .text section spanning both heaps */
+	callbacks->each_callback(collector);
+	flush();
+}
+
+}
@@ -0,0 +1,63 @@
+/* GDB's JIT compilation interface. The names and layouts of these are fixed
+by GDB, which sets a breakpoint on __jit_debug_register_code() and reads
+__jit_debug_descriptor whenever it is hit. */
+extern "C" {
+
+struct jit_code_entry {
+	jit_code_entry *next_entry;
+	jit_code_entry *prev_entry;
+	const char *symfile_addr;
+	factor::u64 symfile_size;
+};
+
+struct jit_descriptor {
+	factor::u32 version;
+	factor::u32 action_flag;
+	jit_code_entry *relevant_entry;
+	jit_code_entry *first_entry;
+};
+
+void __jit_debug_register_code();
+extern jit_descriptor __jit_debug_descriptor;
+
+}
+
+namespace factor
+{
+
+/* Code blocks are only registered once this many are pending, or when the
+compiler finishes a batch, so that compiling many words at once only
+builds a handful of symbol files */
+static const cell gdb_jit_batch_size = 1024;
+
+/* Registers code blocks with an attached debugger, as in-memory ELF objects
+with a symbol for each block. Enabled with the -gdb-jit switch.
+
+A freed block's symbol must go away before its memory is reused, or gdb
+shows overlapping symbols. Symbol files which describe freed blocks are
+marked stale, and rebuilt without them on the next flush. */
+struct gdb_jit {
+	/* Code blocks added since the last flush */
+	std::vector<code_block *> pending;
+
+	/* Symbol files registered by this VM, with the blocks they describe */
+	std::map<jit_code_entry *, std::vector<code_block *> > entries;
+
+	/* The symbol file describing each registered block */
+	std::map<code_block *, jit_code_entry *> registered;
+
+	/* Symbol files describing blocks which have since been freed */
+	std::set<jit_code_entry *> stale;
+
+	~gdb_jit();
+
+	void add_code_block(code_block *compiled);
+	void remove_code_block(code_block *compiled);
+	void update_for_sweep(mark_bits<code_block> *state);
+	void flush();
+	void register_all_code_blocks(code_heap *code, callback_heap *callbacks);
+	void unregister_entry(jit_code_entry *entry);
+	void unregister_all();
+};
+
+}
@@ -53,7 +53,7 @@ void factor_vm::load_code_heap(FILE *file, image_header *h, vm_parameters *p)
 	}
 
 	code->allocator->initial_free_list(h->code_size);
-	code->initialize_all_blocks_set();
+	code->initialize_block_starts();
 }
 
 struct startup_fixup {
@@ -221,6 +221,136 @@ void factor_vm::fixup_code(cell data_offset, cell code_offset)
 	code->allocator->iterate(updater,fixup);
 }
 
+/* MurmurHash3's finalizer. Every input bit affects every output bit, and
+it is a bijection, so a change to any single cell of a page always changes
+the page's hash. */
+static inline u64 mix_image_hash(u64 hash)
+{
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static const u64 image_hash_seed = 14695981039346656037ULL;
+
+static u64 hash_image_cells(u64 hash, cell start, cell size)
+{
+	cell *scan = (cell *)start;
+	cell *end = (cell *)(start + size);
+	for(; scan < end; scan++)
+		hash = mix_image_hash(hash ^ (u64)*scan);
+	return hash;
+}
+
+/* Hash of one page of heap memory, used to find pages which changed since
+the base image was saved. A changed page is missed only if its hash
+collides, which takes luck on the order of one in 2^64. */
+static u64 hash_image_page(cell start)
+{
+	return hash_image_cells(image_hash_seed,start,delta_image_page_size);
+}
+
+/* Identifies a full image by its header and both heaps as they are laid
+out in the file */
+static u64 hash_image(image_header *h, cell data_start, cell code_start)
+{
+	u64 hash = hash_image_cells(image_hash_seed,(cell)h,sizeof(image_header));
+	hash = hash_image_cells(hash,data_start,h->data_size);
+	return hash_image_cells(hash,code_start,h->code_size);
+}
+
+static void read_delta_pages(factor_vm *parent, FILE *file, cell start, cell size, cell page_count)
+{
+	std::vector<cell> pages(page_count);
+	if(page_count != 0 && parent->safe_fread(&pages[0],sizeof(cell),page_count,file) != page_count)
+		fatal_error("Truncated delta image",0);
+
+	for(cell i = 0; i < page_count; i++)
+	{
+		cell offset = pages[i] * delta_image_page_size;
+		if(offset >= size)
+			fatal_error("Bad delta image: page out of range",pages[i]);
+
+		cell page_size = std::min(delta_image_page_size,size - offset);
+		if(parent->safe_fread((void *)(start + offset),1,page_size,file) != page_size)
+			fatal_error("Truncated delta image",pages[i]);
+	}
+}
+
+/* The base image is read first, then the pages that changed are read from
+the delta image on top of it. Both were saved by the same process without
+moving the heaps in between, so they agree on where every object lives. */
+void factor_vm::load_delta_image(FILE *file, image_header *h, vm_parameters *p)
+{
+	delta_image_header dh;
+	if(safe_fread(&dh,sizeof(delta_image_header),1,file) != 1)
+		fatal_error("Cannot read delta image header",0);
+
+	std::basic_string<vm_char> base_path(dh.base_path_length,0);
+	if(dh.base_path_length != 0
+		&& safe_fread(&base_path[0],sizeof(vm_char),dh.base_path_length,file) != dh.base_path_length)
+		fatal_error("Cannot read delta image base path",0);
+
+	FILE *base_file = OPEN_READ(base_path.c_str());
+	if(base_file == NULL)
+	{
+		std::cout << "Cannot open base image file: " << base_path.c_str() << std::endl;
+		std::cout << strerror(errno) << std::endl;
+		exit(1);
+	}
+
+	image_header base_h;
+	if(safe_fread(&base_h,sizeof(image_header),1,base_file) != 1)
+		fatal_error("Cannot read base image header",0);
+
+	if(base_h.magic != image_magic)
+		fatal_error("Bad base image: magic number check failed",base_h.magic);
+
+	if(base_h.version != image_version)
+		fatal_error("Bad base image: version number check failed",base_h.version);
+
+	if(base_h.data_relocation_base != h->data_relocation_base
+		|| base_h.code_relocation_base != h->code_relocation_base)
+		fatal_error("Delta image was not saved relative to this base image",0);
+
+	/* The heaps must be big enough for both images */
+	image_header sizes = *h;
+	sizes.data_size = std::max(h->data_size,base_h.data_size);
+	sizes.code_size = std::max(h->code_size,base_h.code_size);
+	if(sizes.code_size > p->code_size)
+		fatal_error("Code heap too small to fit image",sizes.code_size);
+
+	p->tenured_size = std::max((sizes.data_size * 3) / 2,p->tenured_size);
+	init_data_heap(p->young_size,p->aging_size,p->tenured_size);
+	init_code_heap(p->code_size);
+
+	if(safe_fread((void *)data->tenured->start,1,base_h.data_size,base_file) != base_h.data_size)
+		fatal_error("Truncated base image",0);
+	if(base_h.code_size != 0
+		&& safe_fread(code->allocator->first_block(),1,base_h.code_size,base_file) != base_h.code_size)
+		fatal_error("Truncated base image",0);
+
+	safe_fclose(base_file);
+
+	/* A later save-image to the same path usually puts the heaps at the
+	same addresses, so only the contents tell the two bases apart */
+	if(hash_image(&base_h,data->tenured->start,(cell)code->allocator->first_block()) != dh.base_hash)
+		fatal_error("Delta image was not saved relative to this base image",0);
+
+	read_delta_pages(this,file,data->tenured->start,h->data_size,dh.data_page_count);
+	read_delta_pages(this,file,code->allocator->start,h->code_size,dh.code_page_count);
+
+	/* A delta image's heaps were not compacted, so they can contain free
+	blocks below the sizes in the header. Those are left off the free list
+	until the next full collection sweeps them up. */
+	data->tenured->initial_free_list(h->data_size);
+	code->allocator->initial_free_list(h->code_size);
+	code->initialize_block_starts();
+}
+
 bool factor_vm::read_embedded_image_footer(FILE *file, embedded_image_footer *footer)
 {
 	safe_fseek(file, -(off_t)sizeof(embedded_image_footer), SEEK_END);
@@ -268,14 +398,28 @@ void factor_vm::load_image(vm_parameters *p)
 	if(safe_fread(&h,sizeof(image_header),1,file) != 1)
 		fatal_error("Cannot read image header",0);
 
-	if(h.magic != image_magic)
+	if(h.magic != image_magic && h.magic != delta_image_magic)
 		fatal_error("Bad image: magic number check failed",h.magic);
 
 	if(h.version != image_version)
 		fatal_error("Bad image: version number check failed",h.version);
-	
-	load_data_heap(file,&h,p);
-	load_code_heap(file,&h,p);
+
+	u64 start = nano_count();
+	if(h.magic == delta_image_magic)
+	{
+		/* Both heaps are loaded at once; counted as data heap time */
+		load_delta_image(file,&h,p);
+		startup_stats.load_data_heap_time = nano_count() - start;
+	}
+	else
+	{
+		load_data_heap(file,&h,p);
+		startup_stats.load_data_heap_time = nano_count() - start;
+
+		start = nano_count();
+		load_code_heap(file,&h,p);
+		startup_stats.load_code_heap_time = nano_count() - start;
+	}
 
 	safe_fclose(file);
 
@@ -284,20 +428,137 @@ void factor_vm::load_image(vm_parameters *p)
 	cell data_offset = data->tenured->start - h.data_relocation_base;
 	cell code_offset = code->allocator->start - h.code_relocation_base;
 
+	start = nano_count();
 	fixup_data(data_offset,code_offset);
+	startup_stats.fixup_data_time = nano_count() - start;
+
+	start = nano_count();
 	fixup_code(data_offset,code_offset);
+	startup_stats.fixup_code_time = nano_count() - start;
 
 	/* Store image path name */
 	special_objects[OBJ_IMAGE] = allot_alien(false_object,(cell)p->image_path);
 }
 
+/* The image is complete by the time this is called, so a failure is only
+reported, not raised: save-image-and-exit has already compacted the heap,
+and the caller must not be told that a good image was not written. */
+void factor_vm::report_sync_parent_directory(const vm_char *filename)
+{
+	if(!sync_parent_directory(filename))
+		std::cout << "Image saved, but its directory could not be synced: "
+			<< strerror(errno) << std::endl;
+}
+
+void factor_vm::init_image_header(image_header *h, cell magic, cell data_size, cell code_size)
+{
+	h->magic = magic;
+	h->version = image_version;
+	h->data_relocation_base = data->tenured->start;
+	h->data_size = data_size;
+	h->code_relocation_base = code->allocator->start;
+	h->code_size = code_size;
+
+	h->true_object = true_object;
+	h->bignum_zero = bignum_zero;
+	h->bignum_pos_one = bignum_pos_one;
+	h->bignum_neg_one = bignum_neg_one;
+
+	for(cell i = 0; i < special_object_count; i++)
+		h->special_objects[i] = (save_special_p(i) ? special_objects[i] : false_object);
+}
+
 /* Save the current image to disk */
-bool factor_vm::save_image(const vm_char *saving_filename, const vm_char *filename)
+bool factor_vm::save_image(const vm_char *saving_filename, const vm_char *filename, bool sync_p)
 {
-	FILE* file;
 	image_header h;
+	init_image_header(&h,image_magic,
+		data->tenured->occupied_space(),
+		code->allocator->occupied_space());
+
+	if(!write_image_file(saving_filename,&h,sync_p))
+		return false;
+
+	move_file(saving_filename,filename);
+	if(sync_p) report_sync_parent_directory(filename);
+
+	return true;
+}
+
+static void hash_image_pages(cell start, cell size, std::vector<u64> *hashes)
+{
+	hashes->clear();
+	for(cell offset = 0; offset + delta_image_page_size <= size; offset += delta_image_page_size)
+		hashes->push_back(hash_image_page(start + offset));
+}
+
+static void changed_image_pages(cell start, cell size, std::vector<u64> &hashes, std::vector<cell> *pages)
+{
+	for(cell offset = 0; offset < size; offset += delta_image_page_size)
+	{
+		cell index = offset / delta_image_page_size;
+		if(index >= hashes.size()
+			|| offset + delta_image_page_size > size
+			|| hash_image_page(start + offset) != hashes[index])
+			pages->push_back(index);
+	}
+}
 
-	file = OPEN_WRITE(saving_filename);
+static bool write_delta_pages(factor_vm *parent, FILE *file, cell start, cell size, std::vector<cell> &pages)
+{
+	if(pages.empty())
+		return true;
+
+	if(parent->safe_fwrite(&pages[0],sizeof(cell),pages.size(),file) != pages.size())
+		return false;
+
+	std::vector<cell>::const_iterator iter = pages.begin();
+	for(; iter != pages.end(); iter++)
+	{
+		cell offset = *iter * delta_image_page_size;
+		cell page_size = std::min(delta_image_page_size,size - offset);
+		if(parent->safe_fwrite((void *)(start + offset),page_size,1,file) != 1)
+			return false;
+	}
+
+	return true;
+}
+
+/* Remember the heap contents just written by save_image(), which must have
+been called right after a compaction. The path is made absolute, since a
+delta image may be loaded from another working directory. */
+void factor_vm::record_base_image(const vm_char *filename)
+{
+	if(!base_image)
+		base_image = new base_image_snapshot;
+
+	image_header h;
+	init_image_header(&h,image_magic,
+		data->tenured->occupied_space(),
+		code->allocator->occupied_space());
+
+	base_image->path = absolute_path(filename);
+	base_image->hash = hash_image(&h,data->tenured->start,(cell)code->allocator->first_block());
+	base_image->data_relocation_base = data->tenured->start;
+	base_image->code_relocation_base = code->allocator->start;
+	hash_image_pages(data->tenured->start,data->tenured->occupied_space(),&base_image->data_page_hashes);
+	hash_image_pages(code->allocator->start,code->allocator->occupied_space(),&base_image->code_page_hashes);
+}
+
+/* Save only the pages that changed since the last full image saved by this
+process. The heaps must not have been compacted in between, otherwise most
+pages will have changed. */
+bool factor_vm::save_image_delta(const vm_char *saving_filename, const vm_char *filename, bool sync_p)
+{
+	if(!base_image
+		|| base_image->data_relocation_base != data->tenured->start
+		|| base_image->code_relocation_base != code->allocator->start)
+	{
+		std::cout << "save-image-delta failed: no base image was saved at the current heap location" << std::endl;
+		return false;
+	}
+
+	FILE *file = OPEN_WRITE(saving_filename);
 	if(file == NULL)
 	{
 		std::cout << "Cannot open image file: " << saving_filename << std::endl;
@@ -305,32 +566,38 @@ bool factor_vm::save_image(const vm_char *saving_filename, const vm_char *filena
 		return false;
 	}
 
-	h.magic = image_magic;
-	h.version = image_version;
-	h.data_relocation_base = data->tenured->start;
-	h.data_size = data->tenured->occupied_space();
-	h.code_relocation_base = code->allocator->start;
-	h.code_size = code->allocator->occupied_space();
+	image_header h;
+	init_image_header(&h,delta_image_magic,
+		data->tenured->allocated_extent(),
+		code->allocator->allocated_extent());
 
-	h.true_object = true_object;
-	h.bignum_zero = bignum_zero;
-	h.bignum_pos_one = bignum_pos_one;
-	h.bignum_neg_one = bignum_neg_one;
+	std::vector<cell> data_pages, code_pages;
+	changed_image_pages(data->tenured->start,h.data_size,base_image->data_page_hashes,&data_pages);
+	changed_image_pages(code->allocator->start,h.code_size,base_image->code_page_hashes,&code_pages);
 
-	for(cell i = 0; i < special_object_count; i++)
-		h.special_objects[i] = (save_special_p(i) ? special_objects[i] : false_object);
+	delta_image_header dh;
+	dh.base_path_length = base_image->path.size();
+	dh.data_page_count = data_pages.size();
+	dh.code_page_count = code_pages.size();
+	dh.base_hash = base_image->hash;
 
 	bool ok = true;
 
 	if(safe_fwrite(&h,sizeof(image_header),1,file) != 1) ok = false;
-	if(safe_fwrite((void*)data->tenured->start,h.data_size,1,file) != 1) ok = false;
-	if(safe_fwrite(code->allocator->first_block(),h.code_size,1,file) != 1) ok = false;
+	if(safe_fwrite(&dh,sizeof(delta_image_header),1,file) != 1) ok = false;
+	if(safe_fwrite((void *)base_image->path.c_str(),sizeof(vm_char),dh.base_path_length,file) != dh.base_path_length) ok = false;
+	if(!write_delta_pages(this,file,data->tenured->start,h.data_size,data_pages)) ok = false;
+	if(!write_delta_pages(this,file,code->allocator->start,h.code_size,code_pages)) ok = false;
+	if(ok && sync_p && !sync_file(file)) ok = false;
 	safe_fclose(file);
 
 	if(!ok)
-		std::cout << "save-image failed: " << strerror(errno) << std::endl;
+		std::cout << "save-image-delta failed: " << strerror(errno) << std::endl;
 	else
-		move_file(saving_filename,filename); 
+	{
+		move_file(saving_filename,filename);
+		if(sync_p) report_sync_parent_directory(filename);
+	}
 
 	return ok;
 }
@@ -340,11 +607,28 @@ void factor_vm::primitive_save_image()
 	/* do a full GC to push everything into tenured space */
 	primitive_compact_gc();
 
+	bool sync_p = to_boolean(ctx->pop());
+	data_root<byte_array> path2(ctx->pop(),this);
+	path2.untag_check(this);
+	data_root<byte_array> path1(ctx->pop(),this);
+	path1.untag_check(this);
+	if(save_image((vm_char *)(path1.untagged() + 1),(vm_char *)(path2.untagged() + 1),sync_p))
+		record_base_image((vm_char *)(path2.untagged() + 1));
+}
+
+void factor_vm::primitive_save_image_delta()
+{
+	/* do a full GC to push everything into tenured space. Unlike
+	save-image, we don't compact, so that objects stay where they were
+	when the base image was saved. */
+	primitive_full_gc();
+
+	bool sync_p = to_boolean(ctx->pop());
 	data_root<byte_array> path2(ctx->pop(),this);
 	path2.untag_check(this);
 	data_root<byte_array> path1(ctx->pop(),this);
 	path1.untag_check(this);
-	save_image((vm_char *)(path1.untagged() + 1 ),(vm_char *)(path2.untagged() + 1));
+	save_image_delta((vm_char *)(path1.untagged() + 1),(vm_char *)(path2.untagged() + 1),sync_p);
 }
 
 void factor_vm::primitive_save_image_and_exit()
@@ -352,6 +636,7 @@ void factor_vm::primitive_save_image_and_exit()
 	/* We unbox this before doing anything else. This is the only point
 	where we might throw an error, so we have to throw an error here since
 	later steps destroy the current image. */
+	bool sync_p = to_boolean(ctx->pop());
 	data_root<byte_array> path2(ctx->pop(),this);
 	path2.untag_check(this);
 	data_root<byte_array> path1(ctx->pop(),this);
@@ -366,7 +651,7 @@ void factor_vm::primitive_save_image_and_exit()
 		false /* discard objects only reachable from stacks */);
 
 	/* Save the image */
-	if(save_image((vm_char *)(path1.untagged() + 1), (vm_char *)(path2.untagged() + 1)))
+	if(save_image((vm_char *)(path1.untagged() + 1),(vm_char *)(path2.untagged() + 1),sync_p))
 		exit(0);
 	else
 		exit(1);
@@ -2,13 +2,49 @@ namespace factor
 {
 
 static const cell image_magic = 0x0f0e0d0c;
-static const cell image_version = 4;
+static const cell delta_image_magic = 0x0f0e0d0d;
+static const cell image_version = 5;
+
+/* Granularity at which delta images record changes */
+static const cell delta_image_page_size = 4096;
+
+/* Upper bound on a single write() when saving an image; Linux caps a
+write at just under 2Gb anyway */
+static const cell image_write_chunk_size = 256 * 1024 * 1024;
 
 struct embedded_image_footer {
 	cell magic;
 	cell image_offset;
 };
 
+/* A delta image starts with an image_header whose magic number is
+delta_image_magic, followed by this header and the absolute path of the base
+image.
+Then come the changed data heap pages and the changed code heap pages; each
+group is an array of page indices followed by the contents of those pages.
+The last page of a heap may be shorter than delta_image_page_size. */
+struct delta_image_header {
+	/* in vm_chars, not including a terminator */
+	cell base_path_length;
+	cell data_page_count;
+	cell code_page_count;
+	/* Hash of the base image's header and heaps, so that a delta is not
+	applied to a different image saved later at the same path */
+	u64 base_hash;
+};
+
+/* Recorded when save-image writes a full image, so that later delta images
+can be saved relative to it. Only pages lying entirely within the saved heap
+areas have a hash; all other pages are considered changed. */
+struct base_image_snapshot {
+	std::basic_string<vm_char> path;
+	u64 hash;
+	cell data_relocation_base;
+	cell code_relocation_base;
+	std::vector<u64> data_page_hashes;
+	std::vector<u64> code_page_hashes;
+};
+
 struct image_header {
 	cell magic;
 	cell version;
@@ -32,6 +68,25 @@ struct image_header {
 	cell special_objects[special_object_count];
 };
 
+/* Durations of VM startup phases in nanoseconds. Phases which did not run
+are zero. See basis/vm/vm.factor */
+struct startup_statistics {
+	/* nano_count() on entry to init_factor() */
+	u64 start_time;
+	u64 init_contexts_time;
+	u64 load_data_heap_time;
+	u64 load_code_heap_time;
+	u64 fixup_data_time;
+	u64 fixup_code_time;
+	/* Only when starting from a boot image */
+	u64 compile_all_words_time;
+	/* When starting from a boot image, or compiling every quotation in
+	zygote mode */
+	u64 initialize_all_quotations_time;
+	/* All of init_factor() */
+	u64 total_time;
+};
+
 struct vm_parameters {
 	bool embedded_image;
 	const vm_char *image_path;
@@ -43,7 +98,13 @@ struct vm_parameters {
 	bool console;
 	bool signals;
 	cell max_pic_size;
+	cell code_fragmentation;
 	cell callback_size;
+	const vm_char *zygote_path;
+	bool startup_stats;
+	bool perf_map;
+	bool gdb_jit;
+	bool deferred_jit;
 };
 
 }
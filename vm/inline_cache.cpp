@@ -3,11 +3,91 @@
 namespace factor
 {
 
+/* A cache at its nominal size only grows, or replaces an entry that has not
+been hit, if its entries have averaged this many hits recently. Counts are
+halved on every miss, so this is roughly a hits-per-miss ratio. */
+static const fixnum pic_hits_per_entry = 4;
+
+/* Caches never grow beyond this multiple of max_pic_size */
+static const cell pic_growth_factor = 2;
+
 void factor_vm::init_inline_caching(int max_size)
 {
 	max_pic_size = max_size;
 }
 
+code_block *pic_stub_table::find_shared(const pic_stub_key &key)
+{
+	std::map<pic_stub_key,code_block *>::const_iterator iter = shared.find(key);
+	if(iter == shared.end())
+		return NULL;
+	else
+		return iter->second;
+}
+
+void pic_stub_table::add(code_block *compiled, const pic_stub_key &key, bool shared_p)
+{
+	pic_stub &stub = stubs[compiled];
+	stub.references = 0;
+	stub.shared_p = shared_p;
+	stub.key = key;
+
+	if(shared_p)
+		shared[key] = compiled;
+}
+
+void pic_stub_table::add_reference(code_block *compiled)
+{
+	std::map<code_block *,pic_stub>::iterator iter = stubs.find(compiled);
+	if(iter != stubs.end())
+		iter->second.references++;
+}
+
+/* Returns true if the stub is no longer installed at any call site */
+bool pic_stub_table::remove_reference(code_block *compiled)
+{
+	std::map<code_block *,pic_stub>::iterator iter = stubs.find(compiled);
+	if(iter == stubs.end())
+		return false;
+
+	if(iter->second.references > 0)
+		iter->second.references--;
+	return iter->second.references == 0;
+}
+
+void pic_stub_table::remove(code_block *compiled)
+{
+	std::map<code_block *,pic_stub>::iterator iter = stubs.find(compiled);
+	if(iter == stubs.end())
+		return;
+
+	if(iter->second.shared_p)
+		shared.erase(iter->second.key);
+	stubs.erase(iter);
+}
+
+void pic_stub_table::clear()
+{
+	stubs.clear();
+	shared.clear();
+}
+
+void pic_stub_table::update_for_sweep(mark_bits<code_block> *state)
+{
+	std::map<code_block *,pic_stub>::iterator iter = stubs.begin();
+	while(iter != stubs.end())
+	{
+		if(state->marked_p(iter->first))
+			iter++;
+		else
+		{
+			if(iter->second.shared_p)
+				shared.erase(iter->second.key);
+			stubs.erase(iter++);
+		}
+	}
+}
+
 void factor_vm::deallocate_inline_cache(cell return_address)
 {
 	/* Find the call target. */
@@ -16,9 +96,14 @@ void factor_vm::deallocate_inline_cache(cell return_address)
 
 	code_block *old_block = (code_block *)old_entry_point - 1;
 
-	/* Free the old PIC since we know its unreachable */
-	if(old_block->pic_p())
-		code->free(old_block);
+	/* Free the old PIC once no call site uses it. PICs which are not in
+	the table may be shared with call sites we know nothing about, so the
+	GC frees them. */
+	if(old_block->pic_p() && pic_stubs.remove_reference(old_block))
+	{
+		pic_stubs.remove(old_block);
+		free_code_block(old_block);
+	}
 }
 
 /* Figure out what kind of type check the PIC needs based on the methods
@@ -28,7 +113,7 @@ cell factor_vm::determine_inline_cache_type(array *cache_entries)
 	bool seen_tuple = false;
 
 	cell i;
-	for(i = 0; i < array_capacity(cache_entries); i += 2)
+	for(i = 0; i < array_capacity(cache_entries); i += pic_entry_size)
 	{
 		/* Is it a tuple layout? */
 		if(TAG(array_nth(cache_entries,i)) == ARRAY_TYPE)
@@ -55,6 +140,7 @@ struct inline_cache_jit : public jit {
 	explicit inline_cache_jit(cell generic_word_,factor_vm *vm) : jit(code_block_pic,generic_word_,vm) {};
 
 	void emit_check(cell klass);
+	void emit_hit(cell cache_entries, cell i, cell method);
 	void compile_inline_cache(fixnum index,
 		cell generic_word_,
 		cell methods_,
@@ -73,8 +159,27 @@ void inline_cache_jit::emit_check(cell klass)
 	emit_with_literal(code_template,klass);
 }
 
+/* Jump to the method of the ith entry, counting the hit if we can */
+void inline_cache_jit::emit_hit(cell cache_entries_, cell i, cell method_)
+{
+	data_root<array> cache_entries(cache_entries_,parent);
+	data_root<word> method(method_,parent);
+
+	cell code_template = parent->special_objects[PIC_COUNT_HIT];
+	if(to_boolean(code_template))
+	{
+		cell count_offset = (cell)(cache_entries->data() + i + 2) - cache_entries.value();
+		literal(cache_entries.value());
+		literal(tag_fixnum(count_offset));
+		literal(method.value());
+		emit(code_template);
+	}
+	else
+		emit_with_literal(parent->special_objects[PIC_HIT],method.value());
+}
+
 /* index: 0 = top of stack, 1 = item underneath, etc
-   cache_entries: array of class/method pairs */
+   cache_entries: array of class/method/hit count triples */
 void inline_cache_jit::compile_inline_cache(fixnum index,
 	cell generic_word_,
 	cell methods_,
@@ -92,9 +197,11 @@ void inline_cache_jit::compile_inline_cache(fixnum index,
 	emit_with_literal(parent->special_objects[PIC_LOAD],tag_fixnum(-index * sizeof(cell)));
 	emit(parent->special_objects[inline_cache_type]);
 
-	/* Generate machine code to check, in turn, if the class is one of the cached entries. */
+	/* Generate machine code to check, in turn, if the class is one of the cached entries.
+	Entries are sorted by descending hit count, so the hottest class is
+	checked first. */
 	cell i;
-	for(i = 0; i < array_capacity(cache_entries.untagged()); i += 2)
+	for(i = 0; i < array_capacity(cache_entries.untagged()); i += pic_entry_size)
 	{
 		/* Class equal? */
 		cell klass = array_nth(cache_entries.untagged(),i);
@@ -102,7 +209,7 @@ void inline_cache_jit::compile_inline_cache(fixnum index,
 
 		/* Yes? Jump to method */
 		cell method = array_nth(cache_entries.untagged(),i + 1);
-		emit_with_literal(parent->special_objects[PIC_HIT],method);
+		emit_hit(cache_entries.value(),i,method);
 	}
 
 	/* If none of the above conditionals tested true, then execution "falls
@@ -152,30 +259,168 @@ void *factor_vm::megamorphic_call_stub(cell generic_word)
 	return untag<word>(generic_word)->entry_point;
 }
 
+/* Builds the key for the stub with the given cache entries. Returns false
+if the stub should not be shared, because some object in the key could be
+moved by a nursery or aging collection. */
+bool factor_vm::inline_cache_key(pic_stub_key *key,
+	fixnum index,
+	cell generic_word,
+	cell methods,
+	cell cache_entries_,
+	bool tail_call_p)
+{
+	key->generic_word = generic_word;
+	key->methods = methods;
+	key->index = index;
+	key->tail_call_p = tail_call_p;
+	key->entries.clear();
+
+	bool shareable = data->tenured->contains_p(untag<object>(generic_word))
+		&& data->tenured->contains_p(untag<object>(methods));
+
+	array *cache_entries = untag<array>(cache_entries_);
+	for(cell i = 0; i < array_capacity(cache_entries); i += pic_entry_size)
+	{
+		cell klass = array_nth(cache_entries,i);
+		cell method = array_nth(cache_entries,i + 1);
+		key->entries.push_back(klass);
+		key->entries.push_back(method);
+
+		if(TAG(klass) != FIXNUM_TYPE && !data->tenured->contains_p(untag<object>(klass)))
+			shareable = false;
+		if(!data->tenured->contains_p(untag<object>(method)))
+			shareable = false;
+	}
+
+	return shareable;
+}
+
+/* Returns a stub for the given cache entries, reusing one compiled for
+another call site if possible. Hit counts are stored in the cache entries,
+so call sites sharing a stub share their counts.
+Allocates memory */
+code_block *factor_vm::inline_cache_stub(fixnum index,
+	cell generic_word_,
+	cell methods_,
+	cell cache_entries_,
+	bool tail_call_p)
+{
+	data_root<word> generic_word(generic_word_,this);
+	data_root<array> methods(methods_,this);
+	data_root<array> cache_entries(cache_entries_,this);
+
+	pic_stub_key key;
+	if(inline_cache_key(&key,index,generic_word.value(),methods.value(),
+		cache_entries.value(),tail_call_p))
+	{
+		code_block *stub = pic_stubs.find_shared(key);
+		if(stub)
+		{
+			dispatch_stats.pic_stub_reuses++;
+			return stub;
+		}
+	}
+
+	code_block *stub = compile_inline_cache(index,
+		generic_word.value(),
+		methods.value(),
+		cache_entries.value(),
+		tail_call_p);
+
+	/* Compilation may have moved the key's objects */
+	bool shareable = inline_cache_key(&key,index,generic_word.value(),
+		methods.value(),cache_entries.value(),tail_call_p);
+	pic_stubs.add(stub,key,shareable && !pic_stubs.find_shared(key));
+
+	return stub;
+}
+
 cell factor_vm::inline_cache_size(cell cache_entries)
 {
-	return array_capacity(untag_check<array>(cache_entries)) / 2;
+	return array_capacity(untag_check<array>(cache_entries)) / pic_entry_size;
 }
 
-/* Allocates memory */
-cell factor_vm::add_inline_cache_entry(cell cache_entries_, cell klass_, cell method_)
+struct pic_entry {
+	cell index;
+	fixnum hits;
+
+	explicit pic_entry(cell index_, fixnum hits_) : index(index_), hits(hits_) {}
+};
+
+struct pic_entry_hits_comparator {
+	bool operator()(const pic_entry &a, const pic_entry &b)
+	{
+		return a.hits > b.hits;
+	}
+};
+
+/* Build the entries of the cache which replaces the one that just missed:
+the old entries ordered by hit count, plus the new class. At max_pic_size,
+a busy cache replaces an entry that has not been hit, or grows up to its
+limit; an idle or full one goes megamorphic, signalled by returning f.
+Allocates memory */
+cell factor_vm::update_inline_cache_entries(cell cache_entries_, cell klass_, cell method_)
 {
 	data_root<array> cache_entries(cache_entries_,this);
 	data_root<object> klass(klass_,this);
 	data_root<word> method(method_,this);
 
-	cell pic_size = array_capacity(cache_entries.untagged());
-	data_root<array> new_cache_entries(reallot_array(cache_entries.untagged(),pic_size + 2),this);
-	set_array_nth(new_cache_entries.untagged(),pic_size,klass.value());
-	set_array_nth(new_cache_entries.untagged(),pic_size + 1,method.value());
-	return new_cache_entries.value();
+	cell pic_size = inline_cache_size(cache_entries.value());
+
+	std::vector<pic_entry> entries;
+	fixnum total_hits = 0;
+	for(cell i = 0; i < pic_size * pic_entry_size; i += pic_entry_size)
+	{
+		fixnum hits = untag_fixnum(array_nth(cache_entries.untagged(),i + 2));
+		/* A count can only wrap on 32-bit platforms */
+		if(hits < 0) hits = fixnum_max;
+		entries.push_back(pic_entry(i,hits));
+		total_hits += std::min(hits,fixnum_max - total_hits);
+	}
+
+	std::stable_sort(entries.begin(),entries.end(),pic_entry_hits_comparator());
+
+	if(pic_size >= max_pic_size)
+	{
+		bool busy = total_hits >= (fixnum)pic_size * pic_hits_per_entry;
+		if(busy && entries.back().hits == 0)
+		{
+			dispatch_stats.pic_evictions++;
+			entries.pop_back();
+		}
+		else if(busy && pic_size < max_pic_size * pic_growth_factor)
+			dispatch_stats.pic_growths++;
+		else
+		{
+			dispatch_stats.pic_to_mega_transitions++;
+			return false_object;
+		}
+	}
+
+	array *new_cache_entries = allot_array(
+		(entries.size() + 1) * pic_entry_size,
+		false_object);
+
+	/* Decay the counts so that they reflect recent behavior */
+	cell j = 0;
+	for(cell i = 0; i < entries.size(); i++, j += pic_entry_size)
+	{
+		cell index = entries[i].index;
+		set_array_nth(new_cache_entries,j,array_nth(cache_entries.untagged(),index));
+		set_array_nth(new_cache_entries,j + 1,array_nth(cache_entries.untagged(),index + 1));
+		set_array_nth(new_cache_entries,j + 2,tag_fixnum(entries[i].hits / 2));
+	}
+
+	set_array_nth(new_cache_entries,j,klass.value());
+	set_array_nth(new_cache_entries,j + 1,method.value());
+	set_array_nth(new_cache_entries,j + 2,tag_fixnum(0));
+
+	return tag<array>(new_cache_entries);
 }
 
 void factor_vm::update_pic_transitions(cell pic_size)
 {
-	if(pic_size == max_pic_size)
-		dispatch_stats.pic_to_mega_transitions++;
-	else if(pic_size == 0)
+	if(pic_size == 0)
 		dispatch_stats.cold_call_to_ic_transitions++;
 	else if(pic_size == 1)
 		dispatch_stats.ic_to_pic_transitions++;
@@ -211,34 +456,51 @@ void *factor_vm::inline_cache_miss(cell return_address_)
 	update_pic_transitions(pic_size);
 
 	void *xt;
+	code_block *stub = NULL;
 
-	if(pic_size >= max_pic_size)
-		xt = megamorphic_call_stub(generic_word.value());
-	else
-	{
-		cell klass = object_class(object.value());
-		cell method = lookup_method(object.value(),methods.value());
+	cell klass = object_class(object.value());
+	cell method = lookup_method(object.value(),methods.value());
 
-		data_root<array> new_cache_entries(add_inline_cache_entry(
+	if(site_stats)
+	{
+		record_inline_cache_miss(return_address.value,
+			generic_word.value(),
+			tail_call_site,
 			cache_entries.value(),
-			klass,
-			method),this);
+			klass);
+	}
+
+	cell new_cache_entries = update_inline_cache_entries(
+		cache_entries.value(),
+		klass,
+		method);
+
+	if(site_stats && return_address.valid)
+		record_inline_cache_update(return_address.value,new_cache_entries);
 
-		xt = compile_inline_cache(index,
+	if(!to_boolean(new_cache_entries))
+		xt = megamorphic_call_stub(generic_word.value());
+	else
+	{
+		stub = inline_cache_stub(index,
 			generic_word.value(),
 			methods.value(),
-			new_cache_entries.value(),
-			tail_call_site)->entry_point();
+			new_cache_entries,
+			tail_call_site);
+		xt = stub->entry_point();
 	}
 
 	/* Install the new stub. */
 	if(return_address.valid)
 	{
-		/* Since each PIC is only referenced from a single call site,
-		   if the old call target was a PIC, we can deallocate it immediately,
-		   instead of leaving dead PICs around until the next GC. */
+		/* If this call site was the last user of the old PIC, we can
+		   deallocate it immediately, instead of leaving dead PICs around
+		   until the next GC. */
 		deallocate_inline_cache(return_address.value);
 		set_call_target(return_address.value,xt);
+		if(stub) pic_stubs.add_reference(stub);
+		code->add_caller((code_block *)xt - 1,
+			code->code_block_for_address(return_address.value));
 
 #ifdef PIC_DEBUG
 		std::cout << "Updated "
@@ -1,6 +1,58 @@
 namespace factor
 {
 
+/* Identifies the machine code of an inline cache stub. Stubs are shared
+between call sites with equal keys, since many call sites of a generic word
+see the same classes. Keys hold object identities, so only stubs whose key
+objects are all in tenured space are shared; those only move when the data
+heap is compacted, which clears the table. */
+struct pic_stub_key {
+	cell generic_word;
+	cell methods;
+	fixnum index;
+	bool tail_call_p;
+	/* Class/method pairs, in the order the stub checks them */
+	std::vector<cell> entries;
+
+	bool operator<(const pic_stub_key &other) const
+	{
+		if(generic_word != other.generic_word)
+			return generic_word < other.generic_word;
+		if(methods != other.methods)
+			return methods < other.methods;
+		if(index != other.index)
+			return index < other.index;
+		if(tail_call_p != other.tail_call_p)
+			return tail_call_p < other.tail_call_p;
+		return entries < other.entries;
+	}
+};
+
+struct pic_stub {
+	/* Number of call sites the stub is installed at */
+	cell references;
+	bool shared_p;
+	pic_stub_key key;
+};
+
+/* Inline cache stubs are reference counted, so that a stub can be freed as
+soon as the last call site using it moves on, instead of waiting for the
+next GC. A call site that dies with its code block does not drop its
+reference; such stubs are left for the GC to free. Stubs missing from the
+table, because it was cleared, are also left for the GC. */
+struct pic_stub_table {
+	std::map<code_block *,pic_stub> stubs;
+	std::map<pic_stub_key,code_block *> shared;
+
+	code_block *find_shared(const pic_stub_key &key);
+	void add(code_block *compiled, const pic_stub_key &key, bool shared_p);
+	void add_reference(code_block *compiled);
+	bool remove_reference(code_block *compiled);
+	void remove(code_block *compiled);
+	void clear();
+	void update_for_sweep(mark_bits<code_block> *state);
+};
+
 VM_C_API void *inline_cache_miss(cell return_address, factor_vm *vm);
 
 }
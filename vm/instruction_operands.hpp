@@ -35,7 +35,7 @@ enum relocation_type {
 	/* address of inline_cache_miss function. This is a separate
 	relocation to reduce compile time and size for PICs. */
 	RT_INLINE_CACHE_MISS,
-	/* address of safepoint page in code heap */
+	/* address of safepoint page in code heap. Keep this last, see below */
 	RT_SAFEPOINT
 };
 
@@ -68,6 +68,12 @@ enum relocation_class {
 	RC_ABSOLUTE_PPC_2_2_2_2,
 };
 
+/* Relocation entries, both fixed-width and compact, store the type and the
+class in four bits each. A negative array size fails the build if either
+enum outgrows its nibble. */
+typedef char relocation_type_fits_nibble[RT_SAFEPOINT < 16 ? 1 : -1];
+typedef char relocation_class_fits_nibble[RC_ABSOLUTE_PPC_2_2_2_2 < 16 ? 1 : -1];
+
 static const cell rel_absolute_ppc_2_mask = 0x0000ffff;
 static const cell rel_relative_ppc_2_mask = 0x0000fffc;
 static const cell rel_relative_ppc_3_mask = 0x03fffffc;
@@ -132,6 +138,58 @@ struct relocation_entry {
 	}
 };
 
+/* Code blocks store their relocation tables compactly, since most entries
+are only a few bytes apart. Each entry is a byte holding the type and class,
+followed by the difference between its offset and the previous entry's
+offset, zigzag-encoded as an LEB128 varint. Templates in the special objects
+table keep the fixed-width format above. */
+inline static cell compact_relocation_entry_size(relocation_entry rel, cell last_offset)
+{
+	fixnum delta = (fixnum)rel.rel_offset() - (fixnum)last_offset;
+	cell zigzag = (delta < 0 ? (cell)(-delta) * 2 - 1 : (cell)delta * 2);
+	cell size = 2;
+	while(zigzag >= 0x80)
+	{
+		zigzag >>= 7;
+		size++;
+	}
+	return size;
+}
+
+inline static u8 *write_compact_relocation_entry(u8 *out, relocation_entry rel, cell last_offset)
+{
+	fixnum delta = (fixnum)rel.rel_offset() - (fixnum)last_offset;
+	cell zigzag = (delta < 0 ? (cell)(-delta) * 2 - 1 : (cell)delta * 2);
+	*out++ = (u8)((rel.rel_type() << 4) | rel.rel_class());
+	while(zigzag >= 0x80)
+	{
+		*out++ = (u8)(zigzag | 0x80);
+		zigzag >>= 7;
+	}
+	*out++ = (u8)zigzag;
+	return out;
+}
+
+inline static relocation_entry read_compact_relocation_entry(const u8 *&in, cell last_offset)
+{
+	u8 header = *in++;
+	cell zigzag = 0;
+	cell shift = 0;
+	u8 byte;
+	do
+	{
+		byte = *in++;
+		zigzag |= (cell)(byte & 0x7f) << shift;
+		shift += 7;
+	}
+	while(byte & 0x80);
+
+	fixnum delta = (zigzag & 1) ? -(fixnum)((zigzag + 1) >> 1) : (fixnum)(zigzag >> 1);
+	return relocation_entry((relocation_type)(header >> 4),
+		(relocation_class)(header & 0xf),
+		(cell)((fixnum)last_offset + delta));
+}
+
 struct instruction_operand {
 	relocation_entry rel;
 	code_block *compiled;
@@ -17,6 +17,7 @@ jit::jit(code_block_type type_, cell owner_, factor_vm *vm)
 	  parameters(vm),
 	  literals(vm),
 	  computing_offset_p(false),
+	  recording_positions_p(false),
 	  position(0),
 	  offset(0),
 	  parent(vm)
@@ -57,6 +58,12 @@ void jit::emit(cell code_template_)
 
 	data_root<byte_array> insns(array_nth(code_template.untagged(),1),parent);
 
+	if(recording_positions_p)
+	{
+		scan_position entry = { (u32)code.count, (s32)position };
+		positions.push_back(entry);
+	}
+
 	if(computing_offset_p)
 	{
 		cell size = array_capacity(insns.untagged());
@@ -123,6 +130,24 @@ void jit::compute_position(cell offset_)
 	offset = offset_;
 }
 
+/* Records the code offset and position of every template emitted, for
+computing positions of many offsets at once. */
+void jit::record_positions()
+{
+	recording_positions_p = true;
+	position = 0;
+	positions.clear();
+}
+
+/* The recorded positions, followed by an entry for the end of the code */
+std::vector<scan_position> jit::get_positions()
+{
+	std::vector<scan_position> result(positions);
+	scan_position end = { (u32)code.count, -1 };
+	result.push_back(end);
+	return result;
+}
+
 /* Allocates memory */
 code_block *jit::to_code_block(cell frame_size)
 {
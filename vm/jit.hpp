@@ -9,14 +9,18 @@ struct jit {
 	growable_array parameters;
 	growable_array literals;
 	bool computing_offset_p;
+	bool recording_positions_p;
 	fixnum position;
 	cell offset;
+	std::vector<scan_position> positions;
 	factor_vm *parent;
 
 	explicit jit(code_block_type type, cell owner, factor_vm *parent);
 	~jit();
 
 	void compute_position(cell offset);
+	void record_positions();
+	std::vector<scan_position> get_positions();
 
 	void emit_relocation(cell relocation_template);
 	void emit(cell code_template);
@@ -63,7 +67,7 @@ struct jit {
 
 	void set_position(fixnum position_)
 	{
-		if(computing_offset_p)
+		if(computing_offset_p || recording_positions_p)
 			position = position_;
 	}
 
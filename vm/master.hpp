@@ -28,8 +28,11 @@
 #include <list>
 #include <map>
 #include <set>
+#include <string>
 #include <vector>
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <iomanip>
 #include <limits>
 
@@ -108,6 +111,7 @@ namespace factor
 #include "free_list_allocator.hpp"
 #include "write_barrier.hpp"
 #include "object_start_map.hpp"
+#include "code_block_start_map.hpp"
 #include "nursery_space.hpp"
 #include "aging_space.hpp"
 #include "tenured_space.hpp"
@@ -122,7 +126,11 @@ namespace factor
 #include "image.hpp"
 #include "alien.hpp"
 #include "callbacks.hpp"
+#include "perf_map.hpp"
+#include "gdb_jit.hpp"
 #include "dispatch.hpp"
+#include "call_site_stats.hpp"
+#include "inline_cache.hpp"
 #include "entry_points.hpp"
 #include "safepoints.hpp"
 #include "vm.hpp"
@@ -146,7 +154,6 @@ namespace factor
 #include "byte_arrays.hpp"
 #include "jit.hpp"
 #include "quotations.hpp"
-#include "inline_cache.hpp"
 #include "mvm.hpp"
 #include "factor.hpp"
 #include "utilities.hpp"
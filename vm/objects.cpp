@@ -171,6 +171,11 @@ void factor_vm::primitive_become()
 		each_code_block(code_block_visitor);
 	}
 
+	/* Memoized tuple method lookups and shared PIC keys may refer to old
+	objects */
+	clear_tuple_dispatch_cache();
+	pic_stubs.clear();
+
 	/* Since we may have introduced old->new references, need to revisit
 	all objects and code blocks on a minor GC. */
 	data->mark_all_cards();
@@ -107,6 +107,15 @@ enum special_object {
 
 	OBJ_SIGNAL_PIPE = 74,     /* file descriptor for pipe used to communicate signals
 	                          only used on unix */
+
+	/* Counting variant of PIC_HIT; optional, saved with the image */
+	PIC_COUNT_HIT = 75,
+
+	/* Superinstructions for the non-optimizing compiler in quotations.c;
+	optional, saved with the image */
+	JIT_FUSED_WORDS = 76,
+	JIT_FUSED_LITERALS,
+	JIT_FUSED_IFS,
 };
 
 /* save-image-and-exit discards special objects that are filled in on startup
@@ -116,7 +125,8 @@ anyway, to reduce image size */
 
 inline static bool save_special_p(cell i)
 {
-	return (i >= OBJ_FIRST_SAVE && i <= OBJ_LAST_SAVE);
+	return (i >= OBJ_FIRST_SAVE && i <= OBJ_LAST_SAVE)
+		|| (i >= PIC_COUNT_HIT && i <= JIT_FUSED_IFS);
 }
 
 template<typename Iterator> void object::each_slot(Iterator &iter)
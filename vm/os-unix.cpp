@@ -91,6 +91,148 @@ void factor_vm::move_file(const vm_char *path1, const vm_char *path2)
 		general_error(ERROR_IO,tag_fixnum(errno),false_object);
 }
 
+void factor_vm::init_perf_map()
+{
+	std::ostringstream path;
+	path << "/tmp/perf-" << getpid() << ".map";
+	perf = new perf_map(path.str());
+	perf->record_all_code_blocks(code,callbacks);
+}
+
+/* One contiguous region of the image file, written with pwrite() so that
+several can be in flight at once */
+struct image_segment {
+	int fd;
+	char *data;
+	cell size;
+	off_t offset;
+	int error;
+};
+
+static int write_image_segment(image_segment *segment)
+{
+	char *data = segment->data;
+	cell size = segment->size;
+	off_t offset = segment->offset;
+
+	while(size > 0)
+	{
+		ssize_t written = pwrite(segment->fd,data,std::min(size,image_write_chunk_size),offset);
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return errno;
+		}
+		data += written;
+		size -= written;
+		offset += written;
+	}
+
+	return 0;
+}
+
+static void *image_segment_writer(void *arg)
+{
+	/* Leave signal delivery to the VM's own threads */
+	sigset_t mask;
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK,&mask,NULL);
+
+	image_segment *segment = (image_segment *)arg;
+	segment->error = write_image_segment(segment);
+	return NULL;
+}
+
+/* Write the header and data heap on this thread while a second thread
+writes the code heap. Each heap goes out in a few large unbuffered writes
+straight from the heap, bypassing stdio. */
+bool factor_vm::write_image_file(const vm_char *path, image_header *h, bool sync_p)
+{
+	int fd = open(path,O_WRONLY | O_CREAT | O_TRUNC,0666);
+	if(fd < 0)
+	{
+		std::cout << "Cannot open image file: " << path << std::endl;
+		std::cout << strerror(errno) << std::endl;
+		return false;
+	}
+
+	image_segment header = { fd, (char *)h, sizeof(image_header), 0, 0 };
+	image_segment data_heap = { fd, (char *)data->tenured->start, h->data_size,
+		(off_t)sizeof(image_header), 0 };
+	image_segment code_heap = { fd, (char *)code->allocator->first_block(), h->code_size,
+		(off_t)(sizeof(image_header) + h->data_size), 0 };
+
+	THREADHANDLE code_thread = start_thread(image_segment_writer,&code_heap);
+
+	int error = write_image_segment(&header);
+	if(!error) error = write_image_segment(&data_heap);
+	pthread_join(code_thread,NULL);
+	if(!error) error = code_heap.error;
+
+	if(!error && sync_p && fsync(fd) < 0) error = errno;
+	if(close(fd) < 0 && !error) error = errno;
+
+	if(error)
+	{
+		std::cout << "save-image failed: " << strerror(error) << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+/* Relative paths are resolved against the working directory now, rather
+than whenever the path is next used */
+std::basic_string<vm_char> factor_vm::absolute_path(const vm_char *path)
+{
+	if(path[0] == '/')
+		return path;
+
+	char cwd[PATH_MAX + 1];
+	if(getcwd(cwd,sizeof(cwd)) == NULL)
+		return path;
+
+	std::string absolute(cwd);
+	if(absolute.empty() || absolute[absolute.size() - 1] != '/')
+		absolute += '/';
+	return absolute + path;
+}
+
+/* Returns false and sets errno on failure. Does not throw, since the heap
+may already have been destroyed by save-image-and-exit. */
+bool factor_vm::sync_file(FILE *file)
+{
+	safe_fflush(file);
+	return fsync(fileno(file)) == 0;
+}
+
+/* Make a rename into the directory containing path durable. Returns false
+and sets errno on failure; the rename itself has already happened by
+then, so callers only report it. */
+bool factor_vm::sync_parent_directory(const vm_char *path)
+{
+	std::string dir(path);
+	std::string::size_type slash = dir.rfind('/');
+	if(slash == std::string::npos)
+		dir = ".";
+	else if(slash == 0)
+		dir = "/";
+	else
+		dir.resize(slash);
+
+	int fd = open(dir.c_str(),O_RDONLY);
+	if(fd < 0)
+		return false;
+
+	int ret = fsync(fd);
+	int error = errno;
+	close(fd);
+
+	errno = error;
+	return ret == 0;
+}
+
 segment::segment(cell size_, bool executable_p)
 {
 	size = size_;
@@ -146,12 +288,18 @@ void factor_vm::dispatch_signal(void *uap, void (handler)())
 	UAP_SET_TOC_POINTER(uap, (cell)FUNCTION_TOC_POINTER(handler));
 }
 
+#ifdef __APPLE__
+
+/* Samples wall-clock time only; an interval timer is process-wide, so it
+cannot follow the CPU time of the VM thread */
 void factor_vm::start_sampling_profiler_timer()
 {
+	cell interval = 1000000 / samples_per_second;
 	struct itimerval timer;
 	memset((void*)&timer, 0, sizeof(struct itimerval));
-	timer.it_value.tv_usec = 1000000/samples_per_second;
-	timer.it_interval.tv_usec = 1000000/samples_per_second;
+	timer.it_value.tv_sec = interval / 1000000;
+	timer.it_value.tv_usec = interval % 1000000;
+	timer.it_interval = timer.it_value;
 	setitimer(ITIMER_REAL, &timer, NULL);
 }
 
@@ -162,6 +310,47 @@ void factor_vm::end_sampling_profiler_timer()
 	setitimer(ITIMER_REAL, &timer, NULL);
 }
 
+#else
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* The timer signals the VM thread itself, rather than whichever thread the
+kernel picks for a process-wide SIGALRM. Expirations which happen while the
+signal is still pending are merged into it, and reported as dropped samples
+by sample_signal_handler(). */
+void factor_vm::start_sampling_profiler_timer()
+{
+	struct sigevent event;
+	memset(&event, 0, sizeof(struct sigevent));
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGALRM;
+	event.sigev_notify_thread_id = syscall(SYS_gettid);
+
+	clockid_t clock = (sampling_cpu_time_p ? CLOCK_THREAD_CPUTIME_ID : CLOCK_MONOTONIC);
+	if(timer_create(clock, &event, &sampling_timer) < 0)
+	{
+		atomic::store(&sampling_profiler_p, false);
+		general_error(ERROR_IO,tag_fixnum(errno),false_object);
+	}
+
+	cell interval = 1000000000 / samples_per_second;
+	struct itimerspec timer;
+	memset((void*)&timer, 0, sizeof(struct itimerspec));
+	timer.it_value.tv_sec = interval / 1000000000;
+	timer.it_value.tv_nsec = interval % 1000000000;
+	timer.it_interval = timer.it_value;
+	timer_settime(sampling_timer, 0, &timer, NULL);
+}
+
+void factor_vm::end_sampling_profiler_timer()
+{
+	timer_delete(sampling_timer);
+}
+
+#endif
+
 void memory_signal_handler(int signal, siginfo_t *siginfo, void *uap)
 {
 	factor_vm *vm = current_vm();
@@ -229,7 +418,13 @@ void sample_signal_handler(int signal, siginfo_t *siginfo, void *uap)
 		vm = thread_vms.begin()->second;
 	}
 	if (atomic::load(&vm->sampling_profiler_p))
+	{
 		vm->safepoint.enqueue_samples(vm, 1, (cell)UAP_PROGRAM_COUNTER(uap), foreign_thread);
+#ifndef __APPLE__
+		if (siginfo->si_code == SI_TIMER && siginfo->si_overrun > 0)
+			atomic::fetch_add(&vm->dropped_sample_count, (cell)siginfo->si_overrun);
+#endif
+	}
 	else if (!foreign_thread)
 		enqueue_signal(vm, signal);
 }
@@ -555,4 +750,164 @@ void abort()
 	::abort();
 }
 
+/* A zygote request is a sequence of NUL-terminated command line arguments
+for the worker, ended by an empty argument. The worker's argv[0] is the
+zygote's own.
+
+Workers inherit the zygote's heaps, stacks and other VM settings, so VM
+switches such as -pic= or -nosignals cannot take effect in a request. The
+first one found is returned, so that the worker can refuse to start
+instead of silently ignoring it; NULL if there are none. */
+vm_char *factor_vm::read_zygote_request(int fd, int *argc, vm_char ***argv)
+{
+	std::vector<vm_char *> args;
+	args.push_back((*argv)[0]);
+
+	std::string arg;
+	for(;;)
+	{
+		vm_char c;
+		if(!safe_read(fd,&c,1))
+			fatal_error("Zygote client closed connection before sending arguments",0);
+
+		if(c != 0)
+			arg.push_back(c);
+		else if(arg.empty())
+			break;
+		else
+		{
+			args.push_back(STRDUP(arg.c_str()));
+			arg.clear();
+		}
+	}
+
+	/* The strings are referenced by aliens in OBJ_ARGS, so they must live
+	as long as the worker does */
+	vm_char **new_argv = new vm_char *[args.size() + 1];
+	std::copy(args.begin(),args.end(),new_argv);
+	new_argv[args.size()] = NULL;
+
+	*argc = (int)args.size();
+	*argv = new_argv;
+
+	vm_parameters scratch;
+	default_parameters(&scratch);
+	for(cell i = 1; i < args.size(); i++)
+	{
+		if(STRCMP(args[i],STRING_LITERAL("--")) == 0)
+			break;
+		if(parse_vm_parameter(&scratch,args[i]))
+			return args[i];
+	}
+
+	return NULL;
+}
+
+/* Zygote mode, enabled with -zygote=<path>. The image is loaded and warmed
+up once, then we accept connections on a UNIX socket and fork a worker for
+each one. Workers share the zygote's clean heap pages copy-on-write.
+
+This function only returns in a forked worker, after its stdin, stdout and
+stderr have been redirected to the client connection. The first thing the
+client reads from the connection is the worker's pid_t. */
+void factor_vm::run_zygote(vm_parameters *p, int *argc, vm_char ***argv)
+{
+	/* Do work that every worker would otherwise repeat: compile all
+	quotations up front instead of lazily, and compact both heaps so that
+	workers start with an empty nursery and densely packed shared pages. */
+	u64 start = nano_count();
+	compile_all_quotations();
+	startup_stats.initialize_all_quotations_time = nano_count() - start;
+	gc(collect_compact_op,0,false);
+
+	struct sockaddr_un addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(p->zygote_path) >= sizeof(addr.sun_path))
+		fatal_error("Zygote socket path too long",0);
+	strcpy(addr.sun_path,p->zygote_path);
+
+	int listen_fd = socket(AF_UNIX,SOCK_STREAM,0);
+	if(listen_fd < 0)
+		fatal_error("Cannot create zygote socket",errno);
+
+	if(fcntl(listen_fd,F_SETFD,FD_CLOEXEC) < 0)
+		fatal_error("Error with fcntl",errno);
+
+	unlink(p->zygote_path);
+	if(bind(listen_fd,(struct sockaddr *)&addr,sizeof(addr)) < 0)
+		fatal_error("Cannot bind zygote socket",errno);
+
+	if(listen(listen_fd,SOMAXCONN) < 0)
+		fatal_error("Cannot listen on zygote socket",errno);
+
+	/* Let the kernel reap workers. Workers restore the default action,
+	since io.launcher relies on it. */
+	struct sigaction chld_sigaction;
+	memset(&chld_sigaction,0,sizeof(struct sigaction));
+	sigemptyset(&chld_sigaction.sa_mask);
+	chld_sigaction.sa_handler = SIG_IGN;
+	sigaction_safe(SIGCHLD,&chld_sigaction,NULL);
+
+	std::cout << "Zygote listening on " << p->zygote_path << std::endl;
+
+	for(;;)
+	{
+		int conn_fd = accept(listen_fd,NULL,NULL);
+		if(conn_fd < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fatal_error("accept() failed on zygote socket",errno);
+		}
+
+		pid_t pid = fork();
+		if(pid < 0)
+		{
+			std::cout << "Zygote cannot fork worker: " << strerror(errno) << std::endl;
+			safe_close(conn_fd);
+		}
+		else if(pid == 0)
+		{
+			safe_close(listen_fd);
+
+			chld_sigaction.sa_handler = SIG_DFL;
+			sigaction_safe(SIGCHLD,&chld_sigaction,NULL);
+
+			vm_char *vm_switch = read_zygote_request(conn_fd,argc,argv);
+
+			pid_t self = getpid();
+			safe_write(conn_fd,&self,sizeof(self));
+
+			for(int fd = 0; fd <= 2; fd++)
+			{
+				if(dup2(conn_fd,fd) < 0)
+					fatal_error("dup2() failed in zygote worker",errno);
+			}
+			if(conn_fd > 2)
+				safe_close(conn_fd);
+
+			if(vm_switch)
+			{
+				std::cout << "VM switches cannot be passed to a zygote worker: "
+					<< vm_switch << std::endl;
+				exit(1);
+			}
+
+			srand((unsigned int)nano_count());
+
+			/* Workers have their own pid, so perf looks for their
+			code in a different map file */
+			if(perf)
+			{
+				delete perf;
+				init_perf_map();
+			}
+			return;
+		}
+		else
+			safe_close(conn_fd);
+	}
+}
+
 }
@@ -168,6 +168,54 @@ void factor_vm::move_file(const vm_char *path1, const vm_char *path2)
 		general_error(ERROR_IO,tag_fixnum(GetLastError()),false_object);
 }
 
+bool factor_vm::write_image_file(const vm_char *path, image_header *h, bool sync_p)
+{
+	FILE *file = OPEN_WRITE(path);
+	if(file == NULL)
+	{
+		std::cout << "Cannot open image file: " << path << std::endl;
+		std::cout << strerror(errno) << std::endl;
+		return false;
+	}
+
+	/* Heaps are written in one piece each, so stdio buffering only
+	costs an extra copy */
+	setvbuf(file,NULL,_IONBF,0);
+
+	bool ok = true;
+
+	if(safe_fwrite(h,sizeof(image_header),1,file) != 1) ok = false;
+	if(safe_fwrite((void*)data->tenured->start,h->data_size,1,file) != 1) ok = false;
+	if(safe_fwrite(code->allocator->first_block(),h->code_size,1,file) != 1) ok = false;
+	if(ok && sync_p && !sync_file(file)) ok = false;
+	safe_fclose(file);
+
+	if(!ok)
+		std::cout << "save-image failed: " << strerror(errno) << std::endl;
+
+	return ok;
+}
+
+bool factor_vm::sync_file(FILE *file)
+{
+	safe_fflush(file);
+	HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+	return FlushFileBuffers(handle) != 0;
+}
+
+std::basic_string<vm_char> factor_vm::absolute_path(const vm_char *path)
+{
+	std::vector<vm_char> full(MAX_UNICODE_PATH);
+	DWORD length = GetFullPathName(path,MAX_UNICODE_PATH,&full[0],NULL);
+	if(length == 0 || length >= MAX_UNICODE_PATH)
+		return path;
+	return std::basic_string<vm_char>(&full[0],length);
+}
+
+/* Windows has no portable way to flush a directory; the rename done by
+MoveFileEx() is left to the NTFS journal */
+bool factor_vm::sync_parent_directory(const vm_char *path) { return true; }
+
 void factor_vm::init_signals() {}
 
 THREADHANDLE start_thread(void *(*start_routine)(void *), void *args)
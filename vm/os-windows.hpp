@@ -14,6 +14,7 @@
 
 #include <windows.h>
 #include <shellapi.h>
+#include <io.h>
 
 #ifdef _MSC_VER
 	#undef min
@@ -0,0 +1,67 @@
+#include "master.hpp"
+
+namespace factor
+{
+
+perf_map::perf_map(const std::string &path_) :
+	path(path_),
+	file(path_.c_str(),std::ios::out | std::ios::trunc)
+{
+	if(!file)
+		fatal_error("Cannot open perf map file",0);
+}
+
+void perf_map::write_entry(code_block *compiled, const char *prefix)
+{
+	file << std::hex << (cell)compiled->entry_point() << " "
+		<< (compiled->size() - sizeof(code_block)) << std::dec << " "
+		<< prefix;
+	print_code_block_owner(file,compiled->owner);
+	if(!compiled->free_p() && compiled->pic_p())
+		file << " (pic)";
+	file << "\n";
+}
+
+void perf_map::record_code_block(code_block *compiled, const char *prefix)
+{
+	write_entry(compiled,prefix);
+}
+
+void perf_map::flush()
+{
+	file.flush();
+}
+
+struct perf_map_recorder {
+	perf_map *map;
+	const char *prefix;
+
+	explicit perf_map_recorder(perf_map *map_, const char *prefix_) :
+		map(map_), prefix(prefix_) {}
+
+	void operator()(code_block *compiled, cell size)
+	{
+		map->write_entry(compiled,prefix);
+	}
+
+	void operator()(code_block *stub)
+	{
+		map->write_entry(stub,prefix);
+	}
+};
+
+void perf_map::record_all_code_blocks(code_heap *code, callback_heap *callbacks)
+{
+	file.close();
+	file.open(path.c_str(),std::ios::out | std::ios::trunc);
+
+	perf_map_recorder recorder(this,"");
+	code->allocator->iterate(recorder);
+
+	perf_map_recorder callback_recorder(this,"callback ");
+	callbacks->each_callback(callback_recorder);
+
+	file.flush();
+}
+
+}
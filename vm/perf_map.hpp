@@ -0,0 +1,24 @@
+namespace factor
+{
+
+/* Writes a perf map file (/tmp/perf-<pid>.map), listing the address, size
+and name of every code block, so that Linux perf can symbolize samples
+taken in the code heap. Enabled with the -perf-map switch.
+
+Entries are appended as code blocks are created, and flushed in batches:
+when the compiler finishes, before each GC and at exit. Compaction moves
+blocks, so afterwards the whole file is rewritten to describe the new
+layout; samples taken before a compaction are then resolved against it. */
+struct perf_map {
+	std::string path;
+	std::ofstream file;
+
+	explicit perf_map(const std::string &path_);
+
+	void write_entry(code_block *compiled, const char *prefix);
+	void record_code_block(code_block *compiled, const char *prefix = "");
+	void flush();
+	void record_all_code_blocks(code_heap *code, callback_heap *callbacks);
+};
+
+}
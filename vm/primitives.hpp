@@ -32,7 +32,9 @@ namespace factor
 	_(bits_double) \
 	_(bits_float) \
 	_(byte_array) \
+	_(call_site_dispatch_stats) \
 	_(callback) \
+	_(callback_counts) \
 	_(callstack) \
 	_(callstack_bounds) \
 	_(callstack_for) \
@@ -41,8 +43,11 @@ namespace factor
 	_(clear_samples) \
 	_(clone) \
 	_(code_blocks) \
+	_(code_heap_fragmentedp) \
 	_(code_room) \
+	_(compact_code_gc) \
 	_(compact_gc) \
+	_(compile_deferred_quotations) \
 	_(compute_identity_hashcode) \
 	_(context_object) \
 	_(context_object_for) \
@@ -58,8 +63,11 @@ namespace factor
 	_(dll_validp) \
 	_(dlopen) \
 	_(dlsym) \
+	_(dlsym_cache_stats) \
 	_(dlsym_raw) \
 	_(double_bits) \
+	_(drain_samples) \
+	_(dropped_samples) \
 	_(enable_gc_events) \
 	_(existsp) \
 	_(exit) \
@@ -87,6 +95,7 @@ namespace factor
 	_(format_float) \
 	_(fputc) \
 	_(fread) \
+	_(free_callback) \
 	_(fseek) \
 	_(ftell) \
 	_(full_gc) \
@@ -102,6 +111,7 @@ namespace factor
 	_(minor_gc) \
 	_(modify_code_heap) \
 	_(nano_count) \
+	_(optimize_code_layout) \
 	_(optimized_p) \
 	_(quot_compiled_p) \
 	_(quotation_code) \
@@ -114,16 +124,21 @@ namespace factor
 	_(sampling_profiler) \
 	_(save_image) \
 	_(save_image_and_exit) \
+	_(save_image_delta) \
+	_(set_call_site_dispatch_stats) \
 	_(set_context_object) \
 	_(set_datastack) \
 	_(set_innermost_stack_frame_quot) \
 	_(set_retainstack) \
+	_(set_sample_buffer) \
+	_(set_sampling_cpu_time) \
 	_(set_slot) \
 	_(set_special_object) \
 	_(set_string_nth_fast) \
 	_(size) \
 	_(sleep) \
 	_(special_object) \
+	_(startup_stats) \
 	_(string) \
 	_(strip_stack_traces) \
 	_(tuple) \
@@ -34,7 +34,13 @@ open-coded as retain stack manipulation surrounding a subroutine call.
 in the VM. They are open-coded and no subroutine call is generated. This
 includes stack shufflers, some fixnum arithmetic words, and words such as tag,
 slot and eq?. A primitive call is relatively expensive (two subroutine calls)
-so this results in a big speedup for relatively little effort. */
+so this results in a big speedup for relatively little effort.
+
+6) Superinstructions: sequences of elements which are common in code that
+stays unoptimized are compiled to a single fused template, if the CPU backend
+defines one. These are a fixnum literal followed by a fixnum arithmetic
+sub-primitive, pairs of stack shufflers, and 'dup' or a fixnum comparison
+followed by an inline 'if'. */
 
 void quotation_jit::init_quotation(cell quot)
 {
@@ -53,6 +59,69 @@ bool quotation_jit::fast_if_p(cell i, cell length)
 		&& array_nth(elements.untagged(),i + 2) == parent->special_objects[JIT_IF_WORD];
 }
 
+/* Superinstruction tables are arrays of { word template } or
+{ word word template } entries. A table is f if the CPU backend has no
+superinstructions of that kind. */
+static cell fused_template(cell table_, cell first, cell second)
+{
+	if(!to_boolean(table_))
+		return false_object;
+
+	array *table = untag<array>(table_);
+	for(cell i = 0; i < array_capacity(table); i++)
+	{
+		array *entry = untag<array>(array_nth(table,i));
+		cell size = array_capacity(entry);
+		if(array_nth(entry,0) == first
+			&& (size == 2 || array_nth(entry,1) == second))
+			return array_nth(entry,size - 1);
+	}
+
+	return false_object;
+}
+
+cell quotation_jit::fused_words_template(cell first, cell second)
+{
+	return fused_template(parent->special_objects[JIT_FUSED_WORDS],first,second);
+}
+
+cell quotation_jit::fused_literal_template(cell word)
+{
+	return fused_template(parent->special_objects[JIT_FUSED_LITERALS],word,false_object);
+}
+
+cell quotation_jit::fused_if_template(cell word)
+{
+	return fused_template(parent->special_objects[JIT_FUSED_IFS],word,false_object);
+}
+
+/* Two words with a fused template, such as 'swap over' */
+bool quotation_jit::fused_words_p(cell i, cell length)
+{
+	return (i + 2) <= length
+		&& tagged<object>(array_nth(elements.untagged(),i + 1)).type_p(WORD_TYPE)
+		&& to_boolean(fused_words_template(array_nth(elements.untagged(),i),
+			array_nth(elements.untagged(),i + 1)));
+}
+
+/* A fixnum followed by a word with a fused template, such as '1 fixnum+fast' */
+bool quotation_jit::fused_literal_p(cell i, cell length)
+{
+	return (i + 2) <= length
+		&& tagged<object>(array_nth(elements.untagged(),i + 1)).type_p(WORD_TYPE)
+		&& to_boolean(fused_literal_template(array_nth(elements.untagged(),i + 1)));
+}
+
+/* A word with a fused template followed by an inline 'if', such as
+'dup [ ... ] [ ... ] if' */
+bool quotation_jit::fused_if_p(cell i, cell length)
+{
+	return (i + 4) == length
+		&& tagged<object>(array_nth(elements.untagged(),i + 1)).type_p(QUOTATION_TYPE)
+		&& fast_if_p(i + 1,length)
+		&& to_boolean(fused_if_template(array_nth(elements.untagged(),i)));
+}
+
 bool quotation_jit::fast_dip_p(cell i, cell length)
 {
 	return (i + 2) <= length && array_nth(elements.untagged(),i + 1) == parent->special_objects[JIT_DIP_WORD];
@@ -196,8 +265,25 @@ void quotation_jit::iterate_quotation()
 		switch(obj.type())
 		{
 		case WORD_TYPE:
+			/* Superinstructions */
+			if(fused_if_p(i,length))
+			{
+				emit_epilog(safepoint, stack_frame);
+				tail_call = true;
+
+				emit_quot(array_nth(elements.untagged(),i + 1));
+				emit_quot(array_nth(elements.untagged(),i + 2));
+				emit(fused_if_template(obj.value()));
+
+				i += 3;
+			}
+			else if(fused_words_p(i,length))
+			{
+				emit(fused_words_template(obj.value(),array_nth(elements.untagged(),i + 1)));
+				i++;
+			}
 			/* Sub-primitives */
-			if(to_boolean(obj.as<word>()->subprimitive))
+			else if(to_boolean(obj.as<word>()->subprimitive))
 			{
 				tail_call = emit_subprimitive(obj.value(), /* word */
 					i == length - 1, /* tail_call_p */
@@ -213,6 +299,16 @@ void quotation_jit::iterate_quotation()
 			else
 				word_call(obj.value());
 			break;
+		case FIXNUM_TYPE:
+			/* Superinstructions */
+			if(fused_literal_p(i,length))
+			{
+				emit_with_literal(fused_literal_template(array_nth(elements.untagged(),i + 1)),obj.value());
+				i++;
+			}
+			else
+				push(obj.value());
+			break;
 		case WRAPPER_TYPE:
 			push(obj.as<wrapper>()->object);
 			break;
@@ -275,7 +371,12 @@ void quotation_jit::iterate_quotation()
 				i++;
 			}
 			else
+			{
+				/* Probably passed to a combinator which will call it
+				soon */
+				if(compiling) parent->defer_jit_compile(obj.value());
 				push(obj.value());
+			}
 			break;
 		case ARRAY_TYPE:
 			/* Method dispatch */
@@ -356,6 +457,46 @@ void factor_vm::primitive_jit_compile()
 	jit_compile_quot(ctx->pop(),true);
 }
 
+/* With -deferred-jit, literal quotations found while compiling are
+queued, and compiled while the VM is idle instead of when first called */
+void factor_vm::defer_jit_compile(cell quot)
+{
+	if(!deferred_jit_p
+		|| deferred_quotations.size() >= max_deferred_quotations
+		|| quot_compiled_p(untag<quotation>(quot)))
+		return;
+
+	if(!deferred_quotation_set_valid_p)
+	{
+		deferred_quotation_set.clear();
+		deferred_quotation_set.insert(deferred_quotations.begin(),deferred_quotations.end());
+		deferred_quotation_set_valid_p = true;
+	}
+
+	if(deferred_quotation_set.insert(quot).second)
+		deferred_quotations.push_back(quot);
+}
+
+/* Compiles queued quotations until the queue is empty or the given
+number of nanoseconds has passed, and outputs true if any are left.
+Called by the I/O thread before it waits for events.
+Allocates memory */
+void factor_vm::primitive_compile_deferred_quotations()
+{
+	u64 deadline = nano_count() + to_unsigned_8(ctx->pop());
+
+	while(!deferred_quotations.empty() && nano_count() < deadline)
+	{
+		cell quot = deferred_quotations.back();
+		deferred_quotations.pop_back();
+		if(deferred_quotation_set_valid_p)
+			deferred_quotation_set.erase(quot);
+		jit_compile_quot(quot,true);
+	}
+
+	ctx->push(tag_boolean(!deferred_quotations.empty()));
+}
+
 void *factor_vm::lazy_jit_compile_entry_point()
 {
 	return untag<word>(special_objects[LAZY_JIT_COMPILE_WORD])->entry_point;
@@ -382,18 +523,49 @@ void factor_vm::primitive_quotation_code()
 	ctx->push(from_unsigned_cell((cell)quot->code() + quot->code()->size()));
 }
 
-/* Allocates memory */
-fixnum factor_vm::quot_code_offset_to_scan(cell quot_, cell offset)
+struct scan_position_comparator {
+	bool operator()(const scan_position &a, const scan_position &b)
+	{
+		return a.code_offset < b.code_offset;
+	}
+};
+
+/* The first time a frame of an unoptimized code block is scanned, the
+quotation is compiled again to record the position of every template
+emitted; later lookups search that table instead of compiling.
+Allocates memory */
+fixnum factor_vm::quot_code_offset_to_scan(code_block *compiled_, cell quot_, cell offset)
 {
-	data_root<quotation> quot(quot_,this);
-	data_root<array> array(quot->array,this);
+	code_root compiled((cell)compiled_,this);
 
-	quotation_jit compiler(quot.value(),false,false,this);
-	compiler.init_quotation(quot.value());
-	compiler.compute_position(offset);
-	compiler.iterate_quotation();
+	if(!code->scan_positions.count(compiled_))
+	{
+		data_root<quotation> quot(quot_,this);
+		data_root<array> array(quot->array,this);
+
+		quotation_jit compiler(quot.value(),false,false,this);
+		compiler.init_quotation(quot.value());
+		compiler.record_positions();
+		compiler.iterate_quotation();
 
-	return compiler.get_position();
+		code->scan_positions[(code_block *)compiled.value] = compiler.get_positions();
+	}
+
+	/* The last entry only marks the end of the code */
+	const std::vector<scan_position> &positions = code->scan_positions[(code_block *)compiled.value];
+	std::vector<scan_position>::const_iterator end = positions.end() - 1;
+
+	scan_position key = { (u32)offset, 0 };
+	std::vector<scan_position>::const_iterator iter
+		= std::lower_bound(positions.begin(),end,key,scan_position_comparator());
+
+	/* Same answers as jit::compute_position(); see jit::emit() */
+	if(iter != end && iter->code_offset == offset)
+		return iter->position - 1;
+	else if(iter == positions.begin() || offset >= end->code_offset)
+		return -1;
+	else
+		return (iter - 1)->position + 1;
 }
 
 cell factor_vm::lazy_jit_compile(cell quot_)
@@ -430,6 +602,23 @@ cell factor_vm::find_all_quotations()
 	return instances(QUOTATION_TYPE);
 }
 
+/* Used by zygote mode, so that workers share the compiled code of every
+quotation instead of each compiling the ones it calls. Stops once half of
+the code heap is used, leaving the rest to the workers.
+Allocates memory */
+void factor_vm::compile_all_quotations()
+{
+	data_root<array> quotations(find_all_quotations(),this);
+
+	cell length = array_capacity(quotations.untagged());
+	for(cell i = 0; i < length; i++)
+	{
+		if(code->allocator->free_space() < code->allocator->size / 2)
+			break;
+		jit_compile_quot(array_nth(quotations.untagged(),i),true);
+	}
+}
+
 void factor_vm::initialize_all_quotations()
 {
 	data_root<array> quotations(find_all_quotations(),this);
@@ -1,6 +1,9 @@
 namespace factor
 {
 
+/* Quotations found after this many are compiled lazily, as usual */
+static const cell max_deferred_quotations = 4096;
+
 struct quotation_jit : public jit {
 	data_root<array> elements;
 	bool compiling, relocate;
@@ -19,6 +22,12 @@ struct quotation_jit : public jit {
 	void emit_prolog(bool safepoint, bool stack_frame);
 	void emit_epilog(bool safepoint, bool stack_frame);
 	bool fast_if_p(cell i, cell length);
+	cell fused_words_template(cell first, cell second);
+	cell fused_literal_template(cell word);
+	cell fused_if_template(cell word);
+	bool fused_words_p(cell i, cell length);
+	bool fused_literal_p(cell i, cell length);
+	bool fused_if_p(cell i, cell length);
 	bool fast_dip_p(cell i, cell length);
 	bool fast_2dip_p(cell i, cell length);
 	bool fast_3dip_p(cell i, cell length);
@@ -5,6 +5,8 @@ namespace factor
 
 void factor_vm::primitive_exit()
 {
+	if(perf)
+		perf->flush();
 	exit((int)to_fixnum(ctx->pop()));
 }
 
@@ -44,7 +44,12 @@ profiling_sample::profiling_sample(factor_vm *vm,
 void factor_vm::record_sample(bool prolog_p)
 {
 	profiling_sample_count counts = safepoint.sample_counts.record_counts();
-	if (!counts.empty())
+	if (counts.empty())
+		return;
+
+	if (buffered_samples.active_p())
+		record_buffered_sample(prolog_p, counts);
+	else
 		samples.push_back(profiling_sample(this, prolog_p,
 			counts, special_objects[OBJ_CURRENT_THREAD]));
 }
@@ -77,6 +82,144 @@ void factor_vm::record_callstack_sample(cell *begin, cell *end, bool prolog_p)
 	std::reverse(sample_callstacks.begin() + *begin, sample_callstacks.end());
 }
 
+void sample_buffer::reset(cell capacity_, cell frame_capacity_)
+{
+	release();
+	capacity = capacity_;
+	frame_capacity = frame_capacity_;
+	samples.reserve(capacity);
+	frames.reserve(frame_capacity);
+	callstacks.reserve(capacity);
+
+	/* There are never more callstacks than samples, so the index is at most
+	half full */
+	cell index_size = 1;
+	while (index_size < 2 * capacity)
+		index_size <<= 1;
+	index.resize(index_size, 0);
+}
+
+void sample_buffer::release()
+{
+	std::vector<buffered_sample> sample_graveyard;
+	std::vector<cell> frame_graveyard;
+	std::vector<interned_callstack> callstack_graveyard;
+	std::vector<cell> index_graveyard;
+	std::vector<cell> scratch_graveyard;
+	samples.swap(sample_graveyard);
+	frames.swap(frame_graveyard);
+	callstacks.swap(callstack_graveyard);
+	index.swap(index_graveyard);
+	scratch.swap(scratch_graveyard);
+	capacity = 0;
+	frame_capacity = 0;
+	index_valid_p = true;
+}
+
+/* Keeps the storage for reuse */
+void sample_buffer::clear()
+{
+	samples.clear();
+	frames.clear();
+	callstacks.clear();
+	std::fill(index.begin(), index.end(), 0);
+	index_valid_p = true;
+}
+
+cell sample_buffer::hash_frames(std::vector<cell>::const_iterator begin,
+	std::vector<cell>::const_iterator end)
+{
+	cell hash = end - begin;
+	for (; begin != end; ++begin)
+		hash = hash * 31 + (*begin >> TAG_BITS);
+	return hash;
+}
+
+void sample_buffer::index_callstack(cell n)
+{
+	cell mask = index.size() - 1;
+	cell slot = callstacks[n].hash & mask;
+	while (index[slot] != 0)
+		slot = (slot + 1) & mask;
+	index[slot] = n + 1;
+}
+
+void sample_buffer::rebuild_index()
+{
+	std::fill(index.begin(), index.end(), 0);
+	for (cell n = 0; n < callstacks.size(); n++)
+	{
+		interned_callstack &callstack = callstacks[n];
+		callstack.hash = hash_frames(frames.begin() + callstack.begin,
+			frames.begin() + callstack.end);
+		index_callstack(n);
+	}
+	index_valid_p = true;
+}
+
+/* Finds or adds the callstack in scratch. Fails if it is new and there is
+no room left for its frames. */
+bool sample_buffer::intern(cell *callstack)
+{
+	if (!index_valid_p)
+		rebuild_index();
+
+	cell hash = hash_frames(scratch.begin(), scratch.end());
+	cell length = scratch.size();
+	cell mask = index.size() - 1;
+	for (cell slot = hash & mask; index[slot] != 0; slot = (slot + 1) & mask)
+	{
+		cell n = index[slot] - 1;
+		interned_callstack &existing = callstacks[n];
+		if (existing.hash == hash
+			&& existing.end - existing.begin == length
+			&& std::equal(scratch.begin(), scratch.end(),
+				frames.begin() + existing.begin))
+		{
+			*callstack = n;
+			return true;
+		}
+	}
+
+	if (frames.size() + length > frame_capacity)
+		return false;
+
+	interned_callstack added;
+	added.begin = frames.size();
+	frames.insert(frames.end(), scratch.begin(), scratch.end());
+	added.end = frames.size();
+	added.hash = hash;
+	callstacks.push_back(added);
+
+	*callstack = callstacks.size() - 1;
+	index_callstack(*callstack);
+	return true;
+}
+
+void factor_vm::record_buffered_sample(bool prolog_p, profiling_sample_count const &counts)
+{
+	sample_buffer &buffer = buffered_samples;
+
+	if (!buffer.full_p())
+	{
+		buffer.scratch.clear();
+		record_callstack_sample_iterator recorder(&buffer.scratch, prolog_p);
+		iterate_callstack(ctx, recorder);
+		std::reverse(buffer.scratch.begin(), buffer.scratch.end());
+
+		buffered_sample sample;
+		if (buffer.intern(&sample.callstack))
+		{
+			sample.counts = counts;
+			sample.thread = special_objects[OBJ_CURRENT_THREAD];
+			buffer.samples.push_back(sample);
+			return;
+		}
+	}
+
+	atomic::fetch_add(&dropped_sample_count, (cell)counts.sample_count);
+}
+
 void factor_vm::set_sampling_profiler(fixnum rate)
 {
 	bool sampling_p = !!rate;
@@ -97,15 +240,27 @@ void factor_vm::clear_samples()
 	std::vector<cell> sample_callstack_graveyard;
 	samples.swap(sample_graveyard);
 	sample_callstacks.swap(sample_callstack_graveyard);
+	// While continuous profiling is on, keep the buffer so that later
+	// samples still go to it rather than the unbounded vectors
+	if (sample_buffer_size > 0)
+		buffered_samples.clear();
+	else
+		buffered_samples.release();
 }
 
 void factor_vm::start_sampling_profiler(fixnum rate)
 {
-	samples_per_second = rate;
+	samples_per_second = std::min(rate,max_samples_per_second);
 	safepoint.sample_counts.clear();
+	dropped_sample_count = 0;
 	clear_samples();
-	samples.reserve(10*rate);
-	sample_callstacks.reserve(100*rate);
+	if (sample_buffer_size > 0)
+		buffered_samples.reset(sample_buffer_size, sample_buffer_frames);
+	else
+	{
+		samples.reserve(10*samples_per_second);
+		sample_callstacks.reserve(100*samples_per_second);
+	}
 	atomic::store(&sampling_profiler_p, true);
 	start_sampling_profiler_timer();
 }
@@ -133,16 +288,6 @@ void factor_vm::primitive_get_samples()
 
 		for (; from_iter != samples.end(); ++from_iter, ++to_i)
 		{
-			data_root<array> sample(allot_array(7, false_object),this);
-
-			set_array_nth(sample.untagged(),0,tag_fixnum(from_iter->counts.sample_count));
-			set_array_nth(sample.untagged(),1,tag_fixnum(from_iter->counts.gc_sample_count));
-			set_array_nth(sample.untagged(),2,tag_fixnum(from_iter->counts.jit_sample_count));
-			set_array_nth(sample.untagged(),3,tag_fixnum(from_iter->counts.foreign_sample_count));
-			set_array_nth(sample.untagged(),4,tag_fixnum(from_iter->counts.foreign_thread_sample_count));
-
-			set_array_nth(sample.untagged(),5,from_iter->thread);
-
 			cell callstack_size = from_iter->callstack_end - from_iter->callstack_begin;
 			data_root<array> callstack(allot_array(callstack_size,false_object),this);
 
@@ -155,17 +300,89 @@ void factor_vm::primitive_get_samples()
 			for (; c_from_iter != c_from_iter_end; ++c_from_iter, ++c_to_i)
 				set_array_nth(callstack.untagged(),c_to_i,*c_from_iter);
 
-			set_array_nth(sample.untagged(),6,callstack.value());
-
-			set_array_nth(samples_array.untagged(),to_i,sample.value());
+			cell sample = profiling_sample_array(from_iter->counts,
+				from_iter->thread, callstack.value());
+			set_array_nth(samples_array.untagged(),to_i,sample);
 		}
 		ctx->push(samples_array.value());
 	}
 }
 
+/* Takes all samples from the sample buffer, whether or not the profiler is
+running. Samples which shared an interned callstack share its array. */
+void factor_vm::primitive_drain_samples()
+{
+	sample_buffer &buffer = buffered_samples;
+	if (buffer.samples.empty())
+	{
+		ctx->push(false_object);
+		return;
+	}
+
+	data_root<array> callstacks(allot_array(buffer.callstacks.size(),false_object),this);
+	for (cell i = 0; i < buffer.callstacks.size(); i++)
+	{
+		cell callstack_size = buffer.callstacks[i].end - buffer.callstacks[i].begin;
+		array *callstack = allot_array(callstack_size,false_object);
+		for (cell j = 0; j < callstack_size; j++)
+			set_array_nth(callstack,j,buffer.frames[buffer.callstacks[i].begin + j]);
+		set_array_nth(callstacks.untagged(),i,tag<array>(callstack));
+	}
+
+	data_root<array> samples_array(allot_array(buffer.samples.size(),false_object),this);
+	for (cell i = 0; i < buffer.samples.size(); i++)
+	{
+		cell sample = profiling_sample_array(buffer.samples[i].counts,
+			buffer.samples[i].thread,
+			array_nth(callstacks.untagged(),buffer.samples[i].callstack));
+		set_array_nth(samples_array.untagged(),i,sample);
+	}
+
+	buffer.clear();
+	ctx->push(samples_array.value());
+}
+
+/* In the layout tools.profiler.sampling expects */
+cell factor_vm::profiling_sample_array(profiling_sample_count const &counts,
+	cell thread_, cell callstack_)
+{
+	data_root<object> thread(thread_,this);
+	data_root<array> callstack(callstack_,this);
+	array *sample = allot_array(7,false_object);
+
+	set_array_nth(sample,0,tag_fixnum(counts.sample_count));
+	set_array_nth(sample,1,tag_fixnum(counts.gc_sample_count));
+	set_array_nth(sample,2,tag_fixnum(counts.jit_sample_count));
+	set_array_nth(sample,3,tag_fixnum(counts.foreign_sample_count));
+	set_array_nth(sample,4,tag_fixnum(counts.foreign_thread_sample_count));
+	set_array_nth(sample,5,thread.value());
+	set_array_nth(sample,6,callstack.value());
+
+	return tag<array>(sample);
+}
+
 void factor_vm::primitive_clear_samples()
 {
 	clear_samples();
 }
 
+/* Takes effect the next time the profiler is started */
+void factor_vm::primitive_set_sampling_cpu_time()
+{
+	sampling_cpu_time_p = to_boolean(ctx->pop());
+}
+
+/* Takes effect the next time the profiler is started. A sample count of
+zero goes back to keeping every sample until the profiler is stopped. */
+void factor_vm::primitive_set_sample_buffer()
+{
+	sample_buffer_frames = to_cell(ctx->pop());
+	sample_buffer_size = to_cell(ctx->pop());
+}
+
+void factor_vm::primitive_dropped_samples()
+{
+	ctx->push(from_unsigned_cell(atomic::load(&dropped_sample_count)));
+}
+
 }
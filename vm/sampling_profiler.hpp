@@ -1,6 +1,9 @@
 namespace factor
 {
 
+/* Higher rates are clamped to this */
+static const fixnum max_samples_per_second = 10000;
+
 struct profiling_sample_count
 {
 	// Number of samples taken before the safepoint that recorded the sample
@@ -61,4 +64,60 @@ struct profiling_sample
 		cell thread);
 };
 
+/* A sample kept in a sample_buffer. The callstack is an index into the
+buffer's table of interned callstacks. */
+struct buffered_sample
+{
+	profiling_sample_count counts;
+	cell thread;
+	cell callstack;
+};
+
+/* A range of sample_buffer frames */
+struct interned_callstack
+{
+	cell begin, end;
+	cell hash;
+};
+
+/* Fixed-size sample storage, for leaving the profiler on. Samples are
+recorded at safepoints and drained by Factor code, both on the VM thread,
+so no locking is needed. Draining takes every sample and empties the
+callstack table, so neither ever grows past the size it was given;
+samples which do not fit are counted as dropped instead.
+
+Callstacks are interned, so a hot loop takes one table entry however many
+times it is sampled. The hash index is keyed by object addresses, and is
+rebuilt after the GC moves the owner of any frame. */
+struct sample_buffer
+{
+	std::vector<buffered_sample> samples;
+	cell capacity;
+
+	std::vector<cell> frames;
+	cell frame_capacity;
+	std::vector<interned_callstack> callstacks;
+
+	/* Open addressing, callstack index + 1 in each used slot */
+	std::vector<cell> index;
+	bool index_valid_p;
+
+	/* The callstack being recorded */
+	std::vector<cell> scratch;
+
+	sample_buffer() : capacity(0), frame_capacity(0), index_valid_p(true) {}
+
+	bool active_p() const { return capacity > 0; }
+	bool full_p() const { return samples.size() == capacity; }
+
+	void reset(cell capacity, cell frame_capacity);
+	void release();
+	void clear();
+	static cell hash_frames(std::vector<cell>::const_iterator begin,
+		std::vector<cell>::const_iterator end);
+	void index_callstack(cell n);
+	void rebuild_index();
+	bool intern(cell *callstack);
+};
+
 }
@@ -136,6 +136,8 @@ template<typename Fixup> struct slot_visitor {
 	void visit_embedded_literals(code_block *compiled);
 	void visit_sample_callstacks();
 	void visit_sample_threads();
+	void visit_call_site_stats();
+	void visit_deferred_quotations();
 };
 
 template<typename Fixup>
@@ -236,19 +238,10 @@ void slot_visitor<Fixup>::visit_callback_roots()
 template<typename Fixup>
 void slot_visitor<Fixup>::visit_literal_table_roots()
 {
-	std::map<code_block *, cell> *uninitialized_blocks = &parent->code->uninitialized_blocks;
-	std::map<code_block *, cell>::const_iterator iter = uninitialized_blocks->begin();
-	std::map<code_block *, cell>::const_iterator end = uninitialized_blocks->end();
+	std::vector<uninitialized_block> &blocks = parent->code->uninitialized_blocks;
 
-	std::map<code_block *, cell> new_uninitialized_blocks;
-	for(; iter != end; iter++)
-	{
-		new_uninitialized_blocks.insert(std::make_pair(
-			iter->first,
-			visit_pointer(iter->second)));
-	}
-
-	parent->code->uninitialized_blocks = new_uninitialized_blocks;
+	for(cell i = 0; i < blocks.size(); i++)
+		blocks[i].literals = visit_pointer(blocks[i].literals);
 }
 
 template<typename Fixup>
@@ -260,6 +253,17 @@ void slot_visitor<Fixup>::visit_sample_callstacks()
 	{
 		visit_handle(&*iter);
 	}
+
+	sample_buffer &buffer = parent->buffered_samples;
+	for (std::vector<cell>::iterator iter = buffer.frames.begin();
+		iter != buffer.frames.end();
+		++iter)
+	{
+		cell frame = *iter;
+		visit_handle(&*iter);
+		if (*iter != frame)
+			buffer.index_valid_p = false;
+	}
 }
 
 template<typename Fixup>
@@ -271,6 +275,46 @@ void slot_visitor<Fixup>::visit_sample_threads()
 	{
 		visit_handle(&iter->thread);
 	}
+
+	std::vector<buffered_sample> &buffered = parent->buffered_samples.samples;
+	for (std::vector<buffered_sample>::iterator iter = buffered.begin();
+		iter != buffered.end();
+		++iter)
+	{
+		visit_handle(&iter->thread);
+	}
+}
+
+template<typename Fixup>
+void slot_visitor<Fixup>::visit_deferred_quotations()
+{
+	for (std::vector<cell>::iterator iter = parent->deferred_quotations.begin();
+		iter != parent->deferred_quotations.end();
+		++iter)
+	{
+		cell quot = *iter;
+		visit_handle(&*iter);
+		if (*iter != quot)
+			parent->deferred_quotation_set_valid_p = false;
+	}
+}
+
+template<typename Fixup>
+void slot_visitor<Fixup>::visit_call_site_stats()
+{
+	if(!parent->site_stats) return;
+
+	std::vector<call_site>::iterator iter;
+	for(iter = parent->site_stats->sites.begin();
+		iter != parent->site_stats->sites.end();
+		++iter)
+	{
+		visit_handle(&iter->generic_word);
+
+		std::vector<call_site_class>::iterator class_iter;
+		for(class_iter = iter->classes.begin(); class_iter != iter->classes.end(); ++class_iter)
+			visit_handle(&class_iter->klass);
+	}
 }
 
 template<typename Fixup>
@@ -287,6 +331,8 @@ void slot_visitor<Fixup>::visit_roots()
 	visit_literal_table_roots();
 	visit_sample_callstacks();
 	visit_sample_threads();
+	visit_call_site_stats();
+	visit_deferred_quotations();
 
 	visit_object_array(parent->special_objects,parent->special_objects + special_object_count);
 }
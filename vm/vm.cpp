@@ -10,9 +10,19 @@ factor_vm::factor_vm(THREADHANDLE thread) :
 	callback_id(0),
 	c_to_factor_func(NULL),
 	sampling_profiler_p(false),
+	sampling_cpu_time_p(true),
+	dropped_sample_count(0),
 	signal_pipe_input(0),
 	signal_pipe_output(0),
+	sample_buffer_size(0),
+	sample_buffer_frames(0),
 	gc_off(false),
+	deferred_jit_p(false),
+	deferred_quotation_set_valid_p(true),
+	base_image(NULL),
+	perf(NULL),
+	gdb(NULL),
+	site_stats(NULL),
 	current_gc(NULL),
 	current_gc_p(false),
 	current_jit_count(0),
@@ -26,11 +36,33 @@ factor_vm::factor_vm(THREADHANDLE thread) :
 	safepoint()
 {
 	primitive_reset_dispatch_stats();
+	clear_tuple_dispatch_cache();
+	memset(&startup_stats,0,sizeof(startup_statistics));
 }
 
 factor_vm::~factor_vm()
 {
 	delete_contexts();
+	if(base_image)
+	{
+		delete base_image;
+		base_image = NULL;
+	}
+	if(perf)
+	{
+		delete perf;
+		perf = NULL;
+	}
+	if(gdb)
+	{
+		delete gdb;
+		gdb = NULL;
+	}
+	if(site_stats)
+	{
+		delete site_stats;
+		site_stats = NULL;
+	}
 	if(signal_callstack_seg)
 	{
 		delete signal_callstack_seg;
@@ -70,6 +70,14 @@ struct factor_vm
 	volatile cell sampling_profiler_p;
 	fixnum samples_per_second;
 
+	/* Measure the CPU time used by the VM thread instead of wall-clock time
+	between samples, where the platform supports it */
+	bool sampling_cpu_time_p;
+
+	/* Timer expirations which did not result in a sample, because the
+	previous signal was still pending */
+	volatile cell dropped_sample_count;
+
 	/* Global variables used to pass fault handler state from signal handler
 	to VM */
 	bool signal_resumable;
@@ -85,6 +93,11 @@ struct factor_vm
 	std::vector<profiling_sample> samples;
 	std::vector<cell> sample_callstacks;
 
+	/* Used instead of the above while sample_buffer_size is non-zero */
+	sample_buffer buffered_samples;
+	cell sample_buffer_size;
+	cell sample_buffer_frames;
+
 	/* GC is off during heap walking */
 	bool gc_off;
 
@@ -97,6 +110,31 @@ struct factor_vm
 	/* Pinned callback stubs */
 	callback_heap *callbacks;
 
+	/* Quotations to compile when the VM is idle, only if -deferred-jit
+	was given */
+	bool deferred_jit_p;
+	std::vector<cell> deferred_quotations;
+
+	/* The same quotations, to skip ones already queued. Keyed by address,
+	so it is rebuilt after the GC moves a queued quotation. */
+	std::set<cell> deferred_quotation_set;
+	bool deferred_quotation_set_valid_p;
+
+	/* Last full image saved by this process, for delta images */
+	base_image_snapshot *base_image;
+
+	/* Symbols for Linux perf, only if -perf-map was given */
+	perf_map *perf;
+
+	/* Symbols for gdb, only if -gdb-jit was given */
+	gdb_jit *gdb;
+
+	/* Per call site dispatch telemetry, only if enabled */
+	call_site_stats *site_stats;
+
+	/* Inline cache stubs and the call sites sharing them */
+	pic_stub_table pic_stubs;
+
 	/* Only set if we're performing a GC */
 	gc_state *current_gc;
 	volatile cell current_gc_p;
@@ -132,9 +170,23 @@ struct factor_vm
 	/* Method dispatch statistics */
 	dispatch_statistics dispatch_stats;
 
-	/* Number of entries in a polymorphic inline cache */
+	/* Memoized tuple method lookups, cleared on every GC */
+	tuple_dispatch_entry tuple_dispatch_cache[tuple_dispatch_cache_size];
+
+	/* Symbols linked into compiled code */
+	dlsym_cache dlsyms;
+
+	/* Timings recorded by init_factor() */
+	startup_statistics startup_stats;
+
+	/* Number of entries in a polymorphic inline cache before hit counts
+	are consulted; busy caches may grow to twice this size */
 	cell max_pic_size;
 
+	/* Percentage of the code heap's free space which must lie outside its
+	largest free block before it is compacted while idle */
+	cell code_fragmentation_threshold;
+
 	/* Incrementing object counter for identity hashing */
 	cell object_counter;
 
@@ -209,6 +261,8 @@ struct factor_vm
 	// sampling_profiler
 	void clear_samples();
 	void record_sample(bool prolog_p);
+	void record_buffered_sample(bool prolog_p, profiling_sample_count const &counts);
+	cell profiling_sample_array(profiling_sample_count const &counts, cell thread_, cell callstack_);
 	void record_callstack_sample(cell *begin, cell *end, bool prolog_p);
 	void start_sampling_profiler(fixnum rate);
 	void end_sampling_profiler();
@@ -216,6 +270,10 @@ struct factor_vm
 	void primitive_sampling_profiler();
 	void primitive_get_samples();
 	void primitive_clear_samples();
+	void primitive_set_sampling_cpu_time();
+	void primitive_dropped_samples();
+	void primitive_set_sample_buffer();
+	void primitive_drain_samples();
 
 	// errors
 	void general_error(vm_error_type error, cell arg1, cell arg2);
@@ -362,7 +420,9 @@ struct factor_vm
 	void collect_full(bool trace_contexts_p);
 	void collect_compact_impl(bool trace_contexts_p);
 	void collect_compact_code_impl(bool trace_contexts_p);
+	void collect_code_layout_impl(array *owners);
 	void collect_compact(bool trace_contexts_p);
+	void collect_compact_code(bool trace_contexts_p);
 	void collect_growing_heap(cell requested_size, bool trace_contexts_p);
 	void gc(gc_op op, cell requested_size, bool trace_contexts_p);
 	void scrub_context(context *ctx);
@@ -370,6 +430,8 @@ struct factor_vm
 	void primitive_minor_gc();
 	void primitive_full_gc();
 	void primitive_compact_gc();
+	void primitive_compact_code_gc();
+	void primitive_code_heap_fragmentedp();
 	void primitive_enable_gc_events();
 	void primitive_disable_gc_events();
 	object *allot_object(cell type, cell size);
@@ -583,6 +645,8 @@ struct factor_vm
 	void initialize_code_block(code_block *compiled, cell literals);
 	void initialize_code_block(code_block *compiled);
 	void fixup_labels(array *labels, code_block *compiled);
+	byte_array *compact_relocation(byte_array *relocation);
+	void free_code_block(code_block *compiled);
 	code_block *allot_code_block(cell size, code_block_type type);
 	code_block *add_code_block(code_block_type type, cell code_, cell labels_,
 		cell owner_, cell relocation_, cell parameters_, cell literals_,
@@ -598,8 +662,11 @@ struct factor_vm
 
 	void init_code_heap(cell size);
 	void update_code_heap_words(bool reset_inline_caches);
+	void update_callers(code_block *old_block);
 	void initialize_code_blocks();
 	void primitive_modify_code_heap();
+	void update_code_heap_symbols();
+	void primitive_optimize_code_layout();
 	code_heap_room code_room();
 	void primitive_code_room();
 	void primitive_strip_stack_traces();
@@ -609,14 +676,22 @@ struct factor_vm
 	// callbacks
 	void init_callbacks(cell size);
 	void primitive_callback();
+	void primitive_free_callback();
+	void primitive_callback_counts();
 
 	// image
 	void init_objects(image_header *h);
 	void load_data_heap(FILE *file, image_header *h, vm_parameters *p);
 	void load_code_heap(FILE *file, image_header *h, vm_parameters *p);
-	bool save_image(const vm_char *saving_filename, const vm_char *filename);
+	void report_sync_parent_directory(const vm_char *filename);
+	void init_image_header(image_header *h, cell magic, cell data_size, cell code_size);
+	bool save_image(const vm_char *saving_filename, const vm_char *filename, bool sync_p);
+	void record_base_image(const vm_char *filename);
+	bool save_image_delta(const vm_char *saving_filename, const vm_char *filename, bool sync_p);
+	void load_delta_image(FILE *file, image_header *h, vm_parameters *p);
 	void primitive_save_image();
 	void primitive_save_image_and_exit();
+	void primitive_save_image_delta();
 	void fixup_data(cell data_offset, cell code_offset);
 	void fixup_code(cell data_offset, cell code_offset);
 	FILE *open_image(vm_parameters *p);
@@ -661,6 +736,8 @@ struct factor_vm
 	void primitive_dlsym();
 	void primitive_dlsym_raw();
 	void primitive_dlclose();
+	void *cached_dlsym_raw(dll *d, symbol_char *name);
+	void primitive_dlsym_cache_stats();
 	void primitive_dll_validp();
 	char *alien_offset(cell obj);
 
@@ -671,18 +748,23 @@ struct factor_vm
 	void primitive_quotation_code();
 	code_block *jit_compile_quot(cell owner_, cell quot_, bool relocating);
 	void jit_compile_quot(cell quot_, bool relocating);
-	fixnum quot_code_offset_to_scan(cell quot_, cell offset);
+	void defer_jit_compile(cell quot);
+	void primitive_compile_deferred_quotations();
+	fixnum quot_code_offset_to_scan(code_block *compiled, cell quot_, cell offset);
 	cell lazy_jit_compile(cell quot);
 	bool quot_compiled_p(quotation *quot);
 	void primitive_quot_compiled_p();
 	cell find_all_quotations();
 	void initialize_all_quotations();
+	void compile_all_quotations();
 
 	// dispatch
 	cell search_lookup_alist(cell table, cell klass);
 	cell search_lookup_hash(cell table, cell klass, cell hashcode);
 	cell nth_superclass(tuple_layout *layout, fixnum echelon);
 	cell nth_hashcode(tuple_layout *layout, fixnum echelon);
+	cell search_tuple_method(cell layout, cell methods);
+	void clear_tuple_dispatch_cache();
 	cell lookup_tuple_method(cell obj, cell methods);
 	cell lookup_method(cell obj, cell methods);
 	void primitive_lookup_method();
@@ -693,6 +775,14 @@ struct factor_vm
 	void primitive_reset_dispatch_stats();
 	void primitive_dispatch_stats();
 
+	// call site stats
+	void record_inline_cache_miss(cell return_address, cell generic_word,
+		bool tail_call_p, cell cache_entries, cell klass);
+	void record_inline_cache_update(cell return_address, cell new_cache_entries);
+	void record_megamorphic_cache_miss(cell klass);
+	void primitive_set_call_site_dispatch_stats();
+	void primitive_call_site_dispatch_stats();
+
 	// inline cache
 	void init_inline_caching(int max_size);
 	void deallocate_inline_cache(cell return_address);
@@ -700,8 +790,10 @@ struct factor_vm
 	void update_pic_count(cell type);
 	code_block *compile_inline_cache(fixnum index,cell generic_word_,cell methods_,cell cache_entries_,bool tail_call_p);
 	void *megamorphic_call_stub(cell generic_word);
+	bool inline_cache_key(pic_stub_key *key, fixnum index, cell generic_word, cell methods, cell cache_entries, bool tail_call_p);
+	code_block *inline_cache_stub(fixnum index, cell generic_word_, cell methods_, cell cache_entries_, bool tail_call_p);
 	cell inline_cache_size(cell cache_entries);
-	cell add_inline_cache_entry(cell cache_entries_, cell klass_, cell method_);
+	cell update_inline_cache_entries(cell cache_entries_, cell klass_, cell method_);
 	void update_pic_transitions(cell pic_size);
 	void *inline_cache_miss(cell return_address);
 
@@ -715,9 +807,13 @@ struct factor_vm
 	// factor
 	void default_parameters(vm_parameters *p);
 	bool factor_arg(const vm_char *str, const vm_char *arg, cell *value);
+	bool parse_vm_parameter(vm_parameters *p, vm_char *arg);
 	void init_parameters_from_args(vm_parameters *p, int argc, vm_char **argv);
 	void prepare_boot_image();
 	void init_factor(vm_parameters *p);
+	void init_signals_and_console(vm_parameters *p);
+	void print_startup_stats();
+	void primitive_startup_stats();
 	void pass_args_to_factor(int argc, vm_char **argv);
 	void start_factor(vm_parameters *p);
 	void stop_factor();
@@ -731,6 +827,11 @@ struct factor_vm
 	// os-*
 	void primitive_existsp();
 	void move_file(const vm_char *path1, const vm_char *path2);
+	void init_perf_map();
+	bool write_image_file(const vm_char *path, image_header *h, bool sync_p);
+	bool sync_file(FILE *file);
+	bool sync_parent_directory(const vm_char *path);
+	std::basic_string<vm_char> absolute_path(const vm_char *path);
 	void init_ffi();
 	void ffi_dlopen(dll *dll);
 	void *ffi_dlsym(dll *dll, symbol_char *symbol);
@@ -763,8 +864,14 @@ struct factor_vm
 	LONG exception_handler(PEXCEPTION_RECORD e, void *frame, PCONTEXT c, void *dispatch);
 
   #else  // UNIX
+   #ifndef __APPLE__
+	timer_t sampling_timer;
+   #endif
+
 	void dispatch_signal(void *uap, void (handler)());
 	void unix_init_signals();
+	vm_char *read_zygote_request(int fd, int *argc, vm_char ***argv);
+	void run_zygote(vm_parameters *p, int *argc, vm_char ***argv);
   #endif
 
   #ifdef __APPLE__